@@ -0,0 +1,442 @@
+/*Copyright or Copr. Centre National de la Recherche Scientifique (CNRS) (2018)
+Contributors:
+- Vincent Lanore <vincent.lanore@gmail.com>
+
+This software is a computer program whose purpose is to provide a header-only standalone parser for
+NHX (New Hampshire Extended) phylogenetic trees.
+
+This software is governed by the CeCILL-C license under French law and abiding by the rules of
+distribution of free software. You can use, modify and/ or redistribute the software under the terms
+of the CeCILL-C license as circulated by CEA, CNRS and INRIA at the following URL
+"http://www.cecill.info".
+
+As a counterpart to the access to the source code and rights to copy, modify and redistribute
+granted by the license, users are provided only with a limited warranty and the software's author,
+the holder of the economic rights, and the successive licensors have only limited liability.
+
+In this respect, the user's attention is drawn to the risks associated with loading, using,
+modifying and/or developing or reproducing the software by the user in light of its specific status
+of free software, that may mean that it is complicated to manipulate, and that also therefore means
+that it is reserved for developers and experienced professionals having in-depth computer knowledge.
+Users are therefore encouraged to load and test the software's suitability as regards their
+requirements in conditions enabling the security of their systems and/or data to be ensured and,
+more generally, to use and operate it in the same conditions as regards security.
+
+The fact that you are presently reading this means that you have had knowledge of the CeCILL-C
+license and that you accept its terms.*/
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <unordered_map>
+#include <thread>
+#include "nhx-parser.hpp"
+
+using namespace std;
+
+string read_file(const string& path) {
+    ifstream f(path);
+    stringstream ss;
+    ss << f.rdbuf();
+    return ss.str();
+}
+
+// runs f repeatedly and returns the average time per run in microseconds
+template <class F>
+double time_per_run(F f, int nb_runs) {
+    auto begin = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < nb_runs; i++) {
+        f();
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count() /
+           double(nb_runs);
+}
+
+void bench_parse(const string& path) {
+    string input = read_file(path);
+    double us = time_per_run(
+        [&]() {
+            stringstream ss{input};
+            NHXParser parser(ss);
+        },
+        1000);
+    cout << "parse " << path << ": " << us << "us per tree, " << input.size() / us << " MB/s\n";
+
+    double mapped_us = time_per_run([&]() { NHXParser parser{MappedFile(path)}; }, 1000);
+    cout << "parse " << path << " (mapped): " << mapped_us << "us per tree, "
+         << input.size() / mapped_us << " MB/s\n";
+}
+
+// concatenation of nb_copies copies of the tree in path, one per line
+string tree_collection(const string& path, int nb_copies) {
+    string tree_string = read_file(path);
+    string result;
+    for (int i = 0; i < nb_copies; i++) {
+        result += tree_string + "\n";
+    }
+    return result;
+}
+
+void bench_reader(const string& path) {
+    const int nb_trees = 10000;
+    string input = tree_collection(path, nb_trees);
+    double us = time_per_run(
+        [&]() {
+            stringstream ss{input};
+            NHXTreeReader reader(ss);
+            while (reader.next_tree()) {
+            }
+        },
+        5);
+    cout << "read " << nb_trees << " trees like " << path << ": " << us / nb_trees
+         << "us per tree, " << input.size() / us << " MB/s\n";
+}
+
+// parses many copies of a small tree, each into a new tree, with and without an arena
+void bench_arena(const string& path) {
+    const int nb_trees = 10000;
+    string input = read_file(path);
+    double heap_us =
+        time_per_run([&]() { NHXParser parser(input.data(), input.size()); }, nb_trees);
+    Arena arena;
+    NHXParserOptions options;
+    options.arena = &arena;
+    double arena_us = time_per_run(
+        [&]() {
+            {
+                NHXParser parser(input.data(), input.size(), options);
+            }
+            arena.reset();
+        },
+        nb_trees);
+    cout << "parse " << path << " into a new tree: " << heap_us << "us per tree with the heap, "
+         << arena_us << "us per tree with an arena\n";
+}
+
+// balanced binary tree with 2^depth leaves
+string balanced_tree(int depth) {
+    string result = "L";
+    for (int level = 0; level < depth; level++) {
+        result = "(" + result + ":1," + result + ":1)";
+    }
+    return result + ";";
+}
+
+// writing a tree of 1M nodes to memory and to a stream
+void bench_write() {
+    string input = balanced_tree(19);
+    NHXParser parser(input.data(), input.size());
+    auto& tree = dynamic_cast<const DoubleListAnnotatedTree&>(parser.get_tree());
+    string output;
+    double us = time_per_run(
+        [&]() {
+            output.clear();
+            tree.append_nhx(output);
+        },
+        10);
+    cout << "write " << tree.nb_nodes() << " nodes to a string: " << us / 1000 << "ms, "
+         << output.size() / us << " MB/s\n";
+    ofstream null("/dev/null");
+    us = time_per_run([&]() { tree.write_nhx(null); }, 10);
+    cout << "write " << tree.nb_nodes() << " nodes to a stream: " << us / 1000 << "ms, "
+         << output.size() / us << " MB/s\n";
+    NHXWriterOptions canonical;
+    canonical.sorted_tags = true;
+    canonical.sorted_children = true;
+    us = time_per_run(
+        [&]() {
+            output.clear();
+            tree.append_nhx(output, canonical);
+        },
+        10);
+    cout << "write " << tree.nb_nodes() << " nodes to a string in canonical order: " << us / 1000
+         << "ms, " << output.size() / us << " MB/s\n";
+    NHXWriterOptions plain;
+    plain.nhx_tags = false;
+    plain.internal_names = false;
+    plain.length_digits = 0;
+    us = time_per_run(
+        [&]() {
+            output.clear();
+            tree.append_nhx(output, plain);
+        },
+        10);
+    cout << "write " << tree.nb_nodes() << " nodes to a string as plain Newick with shortest "
+         << "lengths: " << us / 1000 << "ms, " << output.size() / us << " MB/s\n";
+}
+
+// writing a tree of 1M nodes after setting a tag on a few nodes, reformatting every node or copying
+// the unmodified subtrees from the input
+void bench_copy_source() {
+    string input = balanced_tree(19);
+    NHXParserOptions options;
+    options.record_spans = true;
+    double parse_us = time_per_run([&]() { NHXParser parser(input.data(), input.size()); }, 5);
+    double record_us =
+        time_per_run([&]() { NHXParser parser(input.data(), input.size(), options); }, 5);
+    NHXParser parser(input.data(), input.size(), options);
+    auto tree = dynamic_cast<const DoubleListAnnotatedTree&>(parser.get_tree());
+    for (int node = 0; node < int(tree.nb_nodes()); node += tree.nb_nodes() / 10) {
+        tree.set_tag(node, "S", "modified");
+    }
+    string output;
+    NHXWriterOptions reformat;
+    reformat.copy_source = false;
+    for (auto writer : {reformat, NHXWriterOptions()}) {
+        double us = time_per_run(
+            [&]() {
+                output.clear();
+                tree.append_nhx(output, writer);
+            },
+            10);
+        cout << "write " << tree.nb_nodes() << " nodes with 11 modified, "
+             << (writer.copy_source ? "copying the source: " : "reformatting: ") << us / 1000
+             << "ms, " << output.size() / us << " MB/s\n";
+    }
+    double copy_us = time_per_run([&]() { output.assign(input); }, 10);
+    cout << "copy of the input: " << copy_us / 1000 << "ms; parse " << parse_us / 1000
+         << "ms, recording spans " << record_us / 1000 << "ms\n";
+}
+
+// opening a tree of 1M nodes in binary format, compared to parsing it
+void bench_binary() {
+    string input = balanced_tree(19);
+    double parse_us = time_per_run([&]() { NHXParser parser(input.data(), input.size()); }, 5);
+    NHXParser parser(input.data(), input.size());
+    auto& tree = dynamic_cast<const DoubleListAnnotatedTree&>(parser.get_tree());
+    string binary;
+    double write_us = time_per_run(
+        [&]() {
+            binary.clear();
+            tree.append_binary(binary);
+        },
+        5);
+    double open_us = time_per_run([&]() { MappedAnnotatedTree(binary.data(), binary.size()); }, 5);
+    MappedAnnotatedTree mapped(binary.data(), binary.size());
+    double copy_us = time_per_run([&]() { mapped.to_tree(); }, 5);
+    cout << "tree of " << tree.nb_nodes() << " nodes: parse " << parse_us / 1000
+         << "ms, write in binary " << write_us / 1000 << "ms (" << binary.size() / 1000000
+         << " MB), open " << open_us << "us, copy " << copy_us / 1000 << "ms\n";
+}
+
+// postorder traversal of a large tree (with an explicit stack), computing subtree sizes
+void bench_traversal() {
+    string input = balanced_tree(19);
+    NHXParser parser(input.data(), input.size());
+    auto& tree = parser.get_tree();
+    vector<int> sizes(tree.nb_nodes());
+    vector<pair<int, bool>> stack;  // node, children already visited
+    double us = time_per_run(
+        [&]() {
+            stack.emplace_back(tree.root(), false);
+            while (not stack.empty()) {
+                auto top = stack.back();
+                stack.pop_back();
+                if (top.second) {
+                    sizes[top.first] = 1;
+                    for (auto child : tree.children(top.first)) {
+                        sizes[top.first] += sizes[child];
+                    }
+                } else {
+                    stack.emplace_back(top.first, true);
+                    for (auto child : tree.children(top.first)) {
+                        stack.emplace_back(child, false);
+                    }
+                }
+            }
+        },
+        20);
+    cout << "postorder traversal of " << tree.nb_nodes()
+         << " nodes: " << us * 1000 / tree.nb_nodes() << "ns per node (root subtree size "
+         << sizes[tree.root()] << ")\n";
+}
+
+// reads the length of every node, by tag name and by tag id
+void bench_tags(const string& path) {
+    NHXParser parser{MappedFile(path)};
+    auto& tree = parser.get_tree();
+    int nb_nodes = tree.nb_nodes();
+    size_t total = 0;
+    double by_name_us = time_per_run(
+        [&]() {
+            for (int node = 0; node < nb_nodes; node++) {
+                total += tree.tag(node, "length").size();
+            }
+        },
+        1000);
+    double by_id_us = time_per_run(
+        [&]() {
+            auto length = tree.tag_id("length");
+            for (int node = 0; node < nb_nodes; node++) {
+                total += tree.tag(node, length).size();
+            }
+        },
+        1000);
+    cout << "read lengths of " << path << ": " << by_name_us * 1000 / nb_nodes
+         << "ns per node by name, " << by_id_us * 1000 / nb_nodes << "ns per node by id ("
+         << total << " characters)\n";
+}
+
+// Random binary tree on leaves [begin, end): the shape only depends on shape_rng, the order of
+// children on order_rng.
+string random_tree(int begin, int end, mt19937& shape_rng, mt19937& order_rng) {
+    if (end - begin == 1) {
+        return "L" + to_string(begin) + ":1";
+    }
+    int middle = uniform_int_distribution<int>(begin + 1, end - 1)(shape_rng);
+    string left = random_tree(begin, middle, shape_rng, order_rng);
+    string right = random_tree(middle, end, shape_rng, order_rng);
+    if (order_rng() % 2) {
+        swap(left, right);
+    }
+    return "(" + left + "," + right + "):1";
+}
+
+// deduplicates trees that only differ by the order of children, using canonical hashes
+void bench_dedup() {
+    const int nb_trees = 10000, nb_shapes = 100, nb_leaves = 50;
+    mt19937 order_rng(0);
+    string input;
+    for (int i = 0; i < nb_trees; i++) {
+        mt19937 shape_rng(i % nb_shapes);
+        input += random_tree(0, nb_leaves, shape_rng, order_rng) + ";\n";
+    }
+    auto trees = parse_tree_collection(input.data(), input.size(), 1);
+    size_t nb_distinct = 0;
+    double us = time_per_run(
+        [&]() {
+            unordered_multimap<uint64_t, size_t> distinct;  // hash -> first tree of its kind
+            for (size_t i = 0; i < trees.size(); i++) {
+                auto hash = trees[i].canonical_hash();
+                auto candidates = distinct.equal_range(hash);
+                bool found = false;
+                for (auto it = candidates.first; it != candidates.second and not found; ++it) {
+                    found = trees[it->second] == trees[i];
+                }
+                if (not found) {
+                    distinct.emplace(hash, i);
+                }
+            }
+            nb_distinct = distinct.size();
+        },
+        5);
+    cout << "deduplicate " << nb_trees << " trees of " << trees[0].nb_nodes()
+         << " nodes: " << us / 1000 << "ms, " << us / nb_trees << "us per tree (" << nb_distinct
+         << " distinct)\n";
+}
+
+// Robinson-Foulds distance between two random trees with 100000 leaves
+void bench_robinson_foulds() {
+    const int nb_leaves = 100000;
+    mt19937 order_rng(0), a_rng(1), b_rng(2);
+    string a_input = random_tree(0, nb_leaves, a_rng, order_rng) + ";";
+    string b_input = random_tree(0, nb_leaves, b_rng, order_rng) + ";";
+    NHXParser a(a_input.data(), a_input.size()), b(b_input.data(), b_input.size());
+    RFDistance distance{0, 0};
+    double us = time_per_run([&]() { distance = robinson_foulds(a.get_tree(), b.get_tree()); }, 10);
+    cout << "Robinson-Foulds distance between trees with " << nb_leaves << " leaves: " << us / 1000
+         << "ms (distance " << distance.distance << ", normalized " << distance.normalized << ")\n";
+}
+
+// all-pairs Robinson-Foulds distances between trees drawn from a limited set of shapes
+void bench_robinson_foulds_matrix() {
+    const int nb_trees = 2000, nb_shapes = 500, nb_leaves = 100;
+    mt19937 order_rng(0);
+    string input;
+    for (int i = 0; i < nb_trees; i++) {
+        mt19937 shape_rng(i % nb_shapes);
+        input += random_tree(0, nb_leaves, shape_rng, order_rng) + ";\n";
+    }
+    auto trees = parse_tree_collection(input.data(), input.size());
+    unsigned max_threads = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned nb_threads : {1u, max_threads}) {
+        double us = time_per_run([&]() { robinson_foulds_matrix(trees, nb_threads); }, 3);
+        cout << "Robinson-Foulds matrix of " << nb_trees << " trees with " << nb_leaves
+             << " leaves on " << nb_threads << " threads: " << us / 1000 << "ms, "
+             << us * 1000 / (nb_trees * (nb_trees - 1) / 2) << "ns per pair\n";
+    }
+}
+
+// split frequencies of a collection of trees, read tree by tree or counted by count_splits
+void bench_split_frequencies() {
+    const int nb_trees = 20000, nb_shapes = 2000, nb_leaves = 50;
+    mt19937 order_rng(0);
+    string input;
+    for (int i = 0; i < nb_trees; i++) {
+        mt19937 shape_rng(i % nb_shapes);
+        input += random_tree(0, nb_leaves, shape_rng, order_rng) + ";\n";
+    }
+    double streamed_us = time_per_run(
+        [&]() {
+            NHXTreeReader reader(input.data(), input.size());
+            SplitFrequencies frequencies;
+            while (reader.next_tree()) {
+                frequencies.add(reader.get_tree());
+            }
+        },
+        3);
+    cout << "count splits of " << nb_trees << " trees with " << nb_leaves
+         << " leaves tree by tree: " << streamed_us / 1000 << "ms, " << input.size() / streamed_us
+         << " MB/s\n";
+    unsigned max_threads = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned nb_threads : {1u, max_threads}) {
+        double us =
+            time_per_run([&]() { count_splits(input.data(), input.size(), nb_threads); }, 3);
+        cout << "count splits of " << nb_trees << " trees with " << nb_leaves << " leaves on "
+             << nb_threads << " threads: " << us / 1000 << "ms, " << input.size() / us << " MB/s\n";
+    }
+    auto frequencies = count_splits(input.data(), input.size());
+    ConsensusOptions options;
+    for (bool greedy : {false, true}) {
+        options.greedy = greedy;
+        double us = time_per_run([&]() { consensus_tree(frequencies, options); }, 10);
+        cout << (greedy ? "greedy" : "majority-rule") << " consensus of "
+             << frequencies.splits().size() << " splits: " << us << "us\n";
+    }
+}
+
+void bench_parallel(const string& path, int nb_trees) {
+    string input = tree_collection(path, nb_trees);
+    unsigned max_threads = std::max(1u, std::thread::hardware_concurrency());
+    vector<unsigned> thread_counts;
+    for (unsigned nb_threads = 1; nb_threads < max_threads; nb_threads *= 2) {
+        thread_counts.push_back(nb_threads);
+    }
+    thread_counts.push_back(max_threads);
+
+    double sequential_us = 0;
+    for (auto nb_threads : thread_counts) {
+        double us = time_per_run(
+            [&]() { parse_tree_collection(input.data(), input.size(), nb_threads); }, 1);
+        if (nb_threads == 1) {
+            sequential_us = us;
+        }
+        cout << "parse " << nb_trees << " trees like " << path << " on " << nb_threads
+             << " threads: " << us / 1000 << "ms, " << input.size() / us << " MB/s, speedup "
+             << sequential_us / us << "\n";
+    }
+}
+
+int main(int argc, char** argv) {
+    string only = argc > 1 ? argv[1] : "";
+    if (only.empty()) {
+        bench_parse("data/tree1.nhx");
+        bench_parse("data/tree2.nhx");
+        bench_reader("data/tree1.nhx");
+        bench_tags("data/tree1.nhx");
+        bench_arena("data/tree2.nhx");
+        bench_traversal();
+        bench_write();
+        bench_binary();
+        bench_copy_source();
+        bench_dedup();
+        bench_robinson_foulds();
+        bench_robinson_foulds_matrix();
+        bench_split_frequencies();
+    }
+    if (only.empty() or only == "parallel") {
+        bench_parallel("data/tree2.nhx", argc > 2 ? std::stoi(argv[2]) : 100000);
+    }
+}
@@ -1,43 +1,1972 @@
 #include "nhx-parser.hpp"
-#include <regex>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <numeric>
+#include <thread>
+
+#if defined(__x86_64__) and (defined(__GNUC__) or defined(__clang__))
+#define NHX_X86_SIMD
+#include <immintrin.h>
+#endif
+
+namespace {
+// Character classes recognized by the lexer
+enum CharClass : unsigned char {
+    OtherChar,
+    SpaceChar,
+    IdentChar,
+    OpenParenthesisChar,
+    CloseParenthesisChar,
+    ColonChar,
+    SemicolonChar,
+    CommaChar,
+    EqualChar,
+    OpenBracketChar,
+    CloseBracketChar
+};
+
+// structural characters, in the same order as their CharClass
+constexpr char structural_chars[] = "():;,=[]";
+
+constexpr CharClass structural_class(int c, int i = 0) {
+    return structural_chars[i] == '\0'
+               ? OtherChar
+               : structural_chars[i] == c ? CharClass(OpenParenthesisChar + i)
+                                          : structural_class(c, i + 1);
+}
+
+constexpr bool is_ident(int c) {
+    return (c >= 'a' and c <= 'z') or (c >= 'A' and c <= 'Z') or (c >= '0' and c <= '9') or
+           c == '.' or c == '_' or c == '-';
+}
+
+// same as std::isspace in the C locale
+constexpr bool is_space(int c) { return c == ' ' or (c >= '\t' and c <= '\r'); }
+
+constexpr CharClass classify(int c) {
+    return is_ident(c) ? IdentChar : is_space(c) ? SpaceChar : structural_class(c);
+}
+
+#define NHX_CLASS_ROW(r)                                                              \
+    classify(r), classify(r + 1), classify(r + 2), classify(r + 3), classify(r + 4),  \
+        classify(r + 5), classify(r + 6), classify(r + 7), classify(r + 8),            \
+        classify(r + 9), classify(r + 10), classify(r + 11), classify(r + 12),         \
+        classify(r + 13), classify(r + 14), classify(r + 15)
+
+// static 256-entry table indexed by byte value
+const CharClass char_classes[256] = {
+    NHX_CLASS_ROW(0),   NHX_CLASS_ROW(16),  NHX_CLASS_ROW(32),  NHX_CLASS_ROW(48),
+    NHX_CLASS_ROW(64),  NHX_CLASS_ROW(80),  NHX_CLASS_ROW(96),  NHX_CLASS_ROW(112),
+    NHX_CLASS_ROW(128), NHX_CLASS_ROW(144), NHX_CLASS_ROW(160), NHX_CLASS_ROW(176),
+    NHX_CLASS_ROW(192), NHX_CLASS_ROW(208), NHX_CLASS_ROW(224), NHX_CLASS_ROW(240)};
+
+#undef NHX_CLASS_ROW
+
+inline CharClass char_class(char c) { return char_classes[static_cast<unsigned char>(c)]; }
+
+const char nhx_open[] = "[&&NHX:";
+const std::size_t nhx_open_size = sizeof(nhx_open) - 1;
+
+bool is_nhx_open(const char* begin, const char* end) {
+    return std::size_t(end - begin) >= nhx_open_size and
+           std::equal(nhx_open, nhx_open + nhx_open_size, begin);
+}
+
+// true if [begin, end) contains nothing but whitespace and complete comments
+bool is_blank(const char* begin, const char* end) {
+    while (begin != end) {
+        if (*begin == '[' and not is_nhx_open(begin, end)) {
+            begin = std::find(begin, end, ']');
+            if (begin == end) {
+                return false;
+            }
+        } else if (char_class(*begin) != SpaceChar) {
+            return false;
+        }
+        begin++;
+    }
+    return true;
+}
+
+/*================================================================================================*/
+// Delimiter search for TreeEndScanner. This is the only place where the input is not consumed token
+// by token, so it is classified 64 bytes at a time, with AVX2 when the CPU supports it (SSE2 is
+// always there on x86-64). Bit i of each mask stands for block[i].
+
+struct BlockMasks {
+    std::uint64_t delimiters;  // ';', '[' and ']'
+    std::uint64_t separators;  // ',' and '(', each of which starts a new node
+};
+
+using ClassifyBlock = BlockMasks (*)(const char* block);
+
+#ifdef NHX_X86_SIMD
+BlockMasks classify_block_sse2(const char* block) {
+    BlockMasks masks{0, 0};
+    for (int i = 0; i < 4; i++) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + 16 * i));
+        __m128i delimiters = _mm_or_si128(
+            _mm_cmpeq_epi8(x, _mm_set1_epi8(';')),
+            _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('[')),
+                         _mm_cmpeq_epi8(x, _mm_set1_epi8(']'))));
+        __m128i separators = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(',')),
+                                          _mm_cmpeq_epi8(x, _mm_set1_epi8('(')));
+        masks.delimiters |= std::uint64_t(unsigned(_mm_movemask_epi8(delimiters))) << (16 * i);
+        masks.separators |= std::uint64_t(unsigned(_mm_movemask_epi8(separators))) << (16 * i);
+    }
+    return masks;
+}
+
+__attribute__((target("avx2"))) BlockMasks classify_block_avx2(const char* block) {
+    BlockMasks masks{0, 0};
+    for (int i = 0; i < 2; i++) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block + 32 * i));
+        __m256i delimiters = _mm256_or_si256(
+            _mm256_cmpeq_epi8(x, _mm256_set1_epi8(';')),
+            _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('[')),
+                            _mm256_cmpeq_epi8(x, _mm256_set1_epi8(']'))));
+        __m256i separators = _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8(',')),
+                                             _mm256_cmpeq_epi8(x, _mm256_set1_epi8('(')));
+        masks.delimiters |= std::uint64_t(unsigned(_mm256_movemask_epi8(delimiters))) << (32 * i);
+        masks.separators |= std::uint64_t(unsigned(_mm256_movemask_epi8(separators))) << (32 * i);
+    }
+    return masks;
+}
+#else
+BlockMasks classify_block_scalar(const char* block) {
+    BlockMasks masks{0, 0};
+    for (int i = 0; i < 64; i++) {
+        char c = block[i];
+        masks.delimiters |= std::uint64_t(c == ';' or c == '[' or c == ']') << i;
+        masks.separators |= std::uint64_t(c == ',' or c == '(') << i;
+    }
+    return masks;
+}
+#endif
+
+ClassifyBlock select_classify_block() {
+#ifdef NHX_X86_SIMD
+    __builtin_cpu_init();  // may run before the constructor that initializes CPU detection
+    return __builtin_cpu_supports("avx2") ? classify_block_avx2 : classify_block_sse2;
+#else
+    return classify_block_scalar;
+#endif
+}
+
+// Implementation of block classification for this CPU, chosen on first use rather than when
+// static objects are initialized, as trees may be parsed from the constructor of one of them.
+ClassifyBlock classify_block() {
+    static const ClassifyBlock selected = select_classify_block();
+    return selected;
+}
+
+// same as classify_block() for the size < 64 bytes starting at block
+BlockMasks classify_short_block(const char* block, std::size_t size) {
+    char padded[64] = {};
+    std::memcpy(padded, block, size);
+    return classify_block()(padded);
+}
+
+// bits begin to end - 1 (0 <= begin <= end <= 64)
+std::uint64_t bit_range(std::ptrdiff_t begin, std::ptrdiff_t end) {
+    std::uint64_t below_end = end == 64 ? ~std::uint64_t(0) : (std::uint64_t(1) << end) - 1;
+    return begin == 64 ? 0 : below_end & (~std::uint64_t(0) << begin);
+}
+}  // namespace
 
 // lexer
 void NHXParser::find_token() {
-    std::map<TokenType, std::regex> token_regexes{{OpenParenthesis, std::regex("\\(")},
-                                                  {CloseParenthesis, std::regex("\\)")},
-                                                  {Colon, std::regex(":")},
-                                                  {Semicolon, std::regex(";")},
-                                                  {Comma, std::regex(",")},
-                                                  {Equal, std::regex("=")},
-                                                  {NHXOpen, std::regex("\\[&&NHX:")},
-                                                  {CommentOpen, std::regex("\\[")},
-                                                  {BracketClose, std::regex("\\]")},
-                                                  {Identifier, std::regex("[a-zA-Z0-9._-]+")}};
-
-    while (std::isspace(*it)) {
+    const char* const end = input_end;
+    while (true) {
+        while (it != end and char_class(*it) == SpaceChar) {
+            it++;
+        }
+        next_token = Token{Invalid, std::size_t(it - input_begin), 1};
+        if (it == end) {
+            next_token.length = 0;
+            return;
+        }
+
+        switch (char_class(*it)) {
+            case IdentChar: {
+                const char* token_begin = it;
+                do {
+                    it++;
+                } while (it != end and char_class(*it) == IdentChar);
+                next_token.type = Identifier;
+                next_token.length = it - token_begin;
+                return;
+            }
+            case OpenParenthesisChar:
+                next_token.type = OpenParenthesis;
+                break;
+            case CloseParenthesisChar:
+                next_token.type = CloseParenthesis;
+                break;
+            case ColonChar:
+                next_token.type = Colon;
+                break;
+            case SemicolonChar:
+                next_token.type = Semicolon;
+                break;
+            case CommaChar:
+                next_token.type = Comma;
+                break;
+            case EqualChar:
+                next_token.type = Equal;
+                break;
+            case CloseBracketChar:
+                next_token.type = BracketClose;
+                break;
+            case OpenBracketChar: {
+                if (is_nhx_open(it, end)) {
+                    next_token.type = NHXOpen;
+                    next_token.length = nhx_open_size;
+                    it += nhx_open_size;
+                    return;
+                }
+                // comment: skip everything up to and including the closing bracket
+                it = std::find(it + 1, end, ']');
+                if (it == end) {
+                    return;  // unterminated comment: Invalid token starting at the bracket
+                }
+                it++;
+                continue;
+            }
+            default:
+                return;  // Invalid token
+        }
+        it++;  // single-character tokens
+        return;
+    }
+}
+
+std::string NHXParser::read_stream(std::istream& is) {
+    std::string result;
+    char buffer[1 << 16];
+    while (is.read(buffer, sizeof(buffer)) or is.gcount() > 0) {
+        result.append(buffer, is.gcount());
+    }
+    return result;
+}
+
+MappedFile::MappedFile(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        throw NHXParserException("Error: could not open " + path + ": " + std::strerror(errno) +
+                                 "\n");
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == -1) {
+        int fstat_errno = errno;
+        close(fd);
+        throw NHXParserException("Error: could not stat " + path + ": " +
+                                 std::strerror(fstat_errno) + "\n");
+    }
+    size_ = file_stat.st_size;
+    if (size_ != 0) {  // mmap does not accept empty mappings
+        void* mapping = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED) {
+            int mmap_errno = errno;
+            close(fd);
+            throw NHXParserException("Error: could not map " + path + ": " +
+                                     std::strerror(mmap_errno) + "\n");
+        }
+        madvise(mapping, size_, MADV_SEQUENTIAL);
+        data_ = static_cast<const char*>(mapping);
+    }
+    close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (data_ != nullptr) {
+        munmap(const_cast<char*>(data_), size_);
+    }
+}
+
+const char* TreeEndScanner::scan(const char* begin, const char* end, bool at_end,
+                                 bool& found) {
+    found = false;
+    if (tree_done) {
+        nb_separators = 0;
+        tree_done = false;
+    }
+    const ClassifyBlock classify = classify_block();
+    const char* p = begin;  // everything before p has been scanned
+    while (p != end) {
+        const char* block = p;
+        std::size_t size = std::min(std::size_t(end - block), std::size_t(64));
+        BlockMasks masks = size == 64 ? classify(block) : classify_short_block(block, size);
+        // separators are counted from top_level (if the scanner is at top level) up to a delimiter
+        const char* top_level = block;
+        auto count_separators = [&](const char* top_level_end) {
+            std::uint64_t range = bit_range(top_level - block, top_level_end - block);
+            nb_separators += __builtin_popcountll(masks.separators & range);
+        };
+        for (; masks.delimiters != 0; masks.delimiters &= masks.delimiters - 1) {
+            const char* d = block + __builtin_ctzll(masks.delimiters);
+            if (d < p) {
+                continue;  // inside an NHX opening sequence
+            }
+            p = d + 1;
+            switch (*d) {
+                case ';':
+                    if (state == TopLevel) {
+                        count_separators(d);
+                        found = tree_done = true;
+                        return p;
+                    }
+                    break;
+                case '[':
+                    if (state == TopLevel) {
+                        count_separators(d);
+                        if (not at_end and std::size_t(end - d) < nhx_open_size) {
+                            return d;
+                        } else if (is_nhx_open(d, end)) {
+                            state = InData;
+                            p = d + nhx_open_size;
+                        } else {
+                            state = InComment;
+                        }
+                    } else if (state == InData) {
+                        state = InDataComment;
+                    }
+                    break;
+                default:  // ']'
+                    if (state == InComment or state == InData) {
+                        state = TopLevel;
+                        top_level = p;
+                    } else if (state == InDataComment) {
+                        state = InData;
+                    }
+            }
+        }
+        if (state == TopLevel) {
+            count_separators(block + size);
+        }
+        p = std::max(p, block + size);
+    }
+    return p;
+}
+
+std::size_t predicted_nb_nodes(const char* data, std::size_t size) {
+    TreeEndScanner scanner;
+    bool found;
+    scanner.scan(data, data + size, true, found);
+    return scanner.nb_nodes();
+}
+
+void NHXTreeReader::parse(const char* data, std::size_t size, std::size_t nb_nodes) {
+    try {
+        parser.parse(data, size, nb_nodes);
+    } catch (NHXParserException& e) {
+        throw NHXParserException("Error in tree " + std::to_string(nb_trees + 1) + ":\n" +
+                                 e.what());
+    }
+    nb_trees++;
+}
+
+bool NHXTreeReader::next_tree() {
+    if (stream != nullptr) {
+        return next_from_stream();
+    }
+    if (is_blank(position, end)) {
+        return false;
+    }
+    bool found;
+    const char* tree_end = scanner.scan(position, end, true, found);
+    if (not found) {  // last tree is not terminated: let the parser report it
+        tree_end = end;
+    }
+    const char* tree_begin = position;
+    position = tree_end;
+    parse(tree_begin, tree_end - tree_begin, scanner.nb_nodes());
+    return true;
+}
+
+bool NHXTreeReader::next_from_stream() {
+    const std::size_t chunk_size = 1 << 16;
+    while (true) {
+        bool found;
+        const char* data = buffer.data();
+        const char* stop =
+            scanner.scan(data + scan_position, data + buffer.size(), not *stream, found);
+        scan_position = stop - data;
+        if (found or (not *stream and not is_blank(data + buffer_begin, data + buffer.size()))) {
+            std::size_t tree_begin = buffer_begin;
+            buffer_begin = scan_position = found ? scan_position : buffer.size();
+            parse(data + tree_begin, scan_position - tree_begin, scanner.nb_nodes());
+            return true;
+        } else if (not *stream) {
+            return false;
+        }
+
+        // drop the input already parsed and read more
+        buffer.erase(0, buffer_begin);
+        scan_position -= buffer_begin;
+        buffer_begin = 0;
+        std::size_t size = buffer.size();
+        buffer.resize(size + chunk_size);
+        stream->read(&buffer[size], chunk_size);
+        buffer.resize(size + stream->gcount());
+    }
+}
+
+namespace {
+// a ';'-terminated tree of a collection
+struct Slice {
+    const char* begin;
+    const char* end;
+    std::size_t nb_nodes;
+};
+
+// locates the trees of a collection with a sequential TreeEndScanner pass
+std::vector<Slice> locate_trees(const char* data, std::size_t size) {
+    std::vector<Slice> slices;
+    TreeEndScanner scanner;
+    const char* position = data;
+    const char* end = data + size;
+    while (not is_blank(position, end)) {
+        bool found;
+        const char* tree_end = scanner.scan(position, end, true, found);
+        if (not found) {  // last tree is not terminated: let the parser report it
+            tree_end = end;
+        }
+        slices.push_back(Slice{position, tree_end, scanner.nb_nodes()});
+        position = tree_end;
+    }
+    return slices;
+}
+
+// number of threads to use for nb_tasks tasks when nb_threads are asked for (0 means one per
+// hardware thread)
+unsigned nb_workers(unsigned nb_threads, std::size_t nb_tasks) {
+    if (nb_threads == 0) {
+        nb_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    return std::max<std::size_t>(1, std::min<std::size_t>(nb_threads, nb_tasks));
+}
+
+// runs worker(t) for t in [0, nb_threads), worker(0) on this thread
+template <class Worker>
+void run_workers(unsigned nb_threads, Worker worker) {
+    std::vector<std::thread> threads;
+    for (unsigned t = 1; t < nb_threads; t++) {
+        threads.emplace_back(worker, t);
+    }
+    worker(0);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+}  // namespace
+
+// Parses trees of a collection on several threads (a friend of NHXParser)
+struct TreeCollectionParser {
+    // Parses slices first to last - 1 on nb_threads threads (see nb_workers), each thread taking
+    // the next unparsed tree until none is left and passing it to f(thread, slice index, tree).
+    // Throws the first error in input order.
+    template <class F>
+    static void parse(const std::vector<Slice>& slices, std::size_t first, std::size_t last,
+                      unsigned nb_threads, const NHXParserOptions& options, F f) {
+        std::vector<std::exception_ptr> errors(last);
+        std::atomic<std::size_t> next_tree{first};
+        std::atomic<bool> failed{false};
+        NHXParserOptions thread_options = options;
+        thread_options.arena = nullptr;  // arenas are not thread-safe
+        run_workers(nb_threads, [&](unsigned thread) {
+            NHXParser parser(thread_options);
+            std::size_t i;
+            while (not failed and (i = next_tree++) < last) {
+                try {
+                    const Slice& slice = slices[i];
+                    parser.parse(slice.begin, slice.end - slice.begin, slice.nb_nodes);
+                    f(thread, i, parser.tree);
+                } catch (...) {
+                    errors[i] = std::current_exception();
+                    failed = true;
+                }
+            }
+        });
+
+        for (std::size_t i = first; i < last; i++) {
+            if (errors[i]) {
+                try {
+                    std::rethrow_exception(errors[i]);
+                } catch (NHXParserException& e) {
+                    throw NHXParserException("Error in tree " + std::to_string(i + 1) + ":\n" +
+                                             e.what());
+                }
+            }
+        }
+    }
+};
+
+std::vector<DoubleListAnnotatedTree> parse_tree_collection(const char* data, std::size_t size,
+                                                           unsigned nb_threads,
+                                                           const NHXParserOptions& options) {
+    std::vector<Slice> slices = locate_trees(data, size);
+    std::vector<DoubleListAnnotatedTree> trees(slices.size());
+    TreeCollectionParser::parse(slices, 0, slices.size(), nb_workers(nb_threads, slices.size()),
+                                options,
+                                [&](unsigned, std::size_t i, DoubleListAnnotatedTree& tree) {
+                                    trees[i] = std::move(tree);
+                                });
+    return trees;
+}
+
+/*================================================================================================*/
+// NHX writer. The text goes to one buffer, handed to flush whenever it holds more than flush_size
+// characters (flush empties it), so that streams and files are written in large chunks.
+namespace {
+const std::size_t write_chunk_size = 1 << 16;
+
+// Appends the number with given significant digits (without leading or trailing zeros, none for
+// 0), the first of them at decimal exponent, in fixed or exponent notation, whichever is shorter.
+void append_decimal(std::string& out, bool negative, const char* digits, int nb_digits,
+                    int exponent) {
+    if (negative) {
+        out += '-';
+    }
+    if (nb_digits == 0) {
+        out += '0';
+        return;
+    }
+    int magnitude = std::abs(exponent);
+    int exponent_length = 1 + (nb_digits > 1 ? nb_digits : 0) + 2 + (magnitude >= 100 ? 3 : 2);
+    int fixed_length = exponent < 0                ? 2 - exponent - 1 + nb_digits
+                       : exponent + 1 >= nb_digits ? exponent + 1
+                                                   : nb_digits + 1;
+    if (fixed_length <= exponent_length) {
+        if (exponent < 0) {
+            out += "0.";
+            out.append(-exponent - 1, '0');
+            out.append(digits, nb_digits);
+        } else if (exponent + 1 >= nb_digits) {
+            out.append(digits, nb_digits);
+            out.append(exponent + 1 - nb_digits, '0');
+        } else {
+            out.append(digits, exponent + 1);
+            out += '.';
+            out.append(digits + exponent + 1, nb_digits - exponent - 1);
+        }
+    } else {
+        out += digits[0];
+        if (nb_digits > 1) {
+            out += '.';
+            out.append(digits + 1, nb_digits - 1);
+        }
+        char text[8];
+        out.append(text, std::snprintf(text, sizeof(text), "e%c%02d", exponent < 0 ? '-' : '+',
+                                       magnitude));
+    }
+}
+
+// Reads a decimal number such as "-0.0125" or "1.25E-2" into the arguments of append_decimal,
+// with at most max_digits digits. Returns false for other numbers and text, and for exponents
+// near the limits of doubles, where the shortest text may have fewer digits than the input.
+bool read_decimal(const char* text, std::size_t size, int max_digits, bool& negative,
+                  char* digits, int& nb_digits, int& exponent) {
+    const char *it = text, *end = text + size;
+    negative = it != end and *it == '-';
+    it += negative;
+    int nb_integer_digits = 0, nb_leading_zeros = 0, nb_mantissa_digits = 0;
+    bool point = false;
+    nb_digits = 0;
+    for (; it != end and ((*it >= '0' and *it <= '9') or (*it == '.' and not point)); it++) {
+        if (*it == '.') {
+            point = true;
+            continue;
+        }
+        nb_mantissa_digits++;
+        nb_integer_digits += not point;
+        if (nb_digits == 0 and *it == '0') {
+            nb_leading_zeros++;
+        } else if (nb_digits < 32) {
+            digits[nb_digits++] = *it;
+        } else {
+            return false;
+        }
+    }
+    int written_exponent = 0;
+    if (it != end and (*it == 'e' or *it == 'E')) {
         it++;
+        bool negative_exponent = it != end and *it == '-';
+        it += it != end and (*it == '-' or *it == '+');
+        if (it == end) {
+            return false;
+        }
+        for (; it != end and *it >= '0' and *it <= '9' and written_exponent < 1000; it++) {
+            written_exponent = written_exponent * 10 + (*it - '0');
+        }
+        written_exponent = negative_exponent ? -written_exponent : written_exponent;
     }
-    int token_number{0};
-    for (auto token_regex : token_regexes) {
-        std::smatch m;
-        auto r = std::regex_search(it, scit(input.end()), m, token_regex.second);
-        if (r and m.prefix() == "") {
-            if (token_regex.first == CommentOpen) {  // support of comments
-                std::string comment_close{"]"};
-                it =
-                    std::search(it, scit(input.end()), comment_close.begin(), comment_close.end()) +
-                    1;
-                find_token();
-                return;
+    while (nb_digits > 0 and digits[nb_digits - 1] == '0') {
+        nb_digits--;
+    }
+    exponent = nb_integer_digits - nb_leading_zeros - 1 + written_exponent;
+    return it == end and nb_mantissa_digits != 0 and nb_digits <= max_digits and
+           std::abs(exponent) <= 300;
+}
+
+// Appends the number in text rounded to digits significant digits, or if digits is 0 the shortest
+// text that reads back as the same double. A number written with at most 15 digits (DBL_DIG) is
+// the shortest text of its double, so it is only reformatted; otherwise the digits come from
+// "%.*e" with 15 to 17 digits, the first that reads back. Returns false if text is not a finite
+// number.
+bool append_number(std::string& out, const char* text, std::size_t size, int digits) {
+    bool negative;
+    char number[64], result[40];
+    int nb_digits, exponent;
+    digits = std::min(digits, 17);
+    if (read_decimal(text, size, digits == 0 ? 15 : std::min(digits, 15), negative, result,
+                     nb_digits, exponent)) {
+        append_decimal(out, negative, result, nb_digits, exponent);
+        return true;
+    }
+    if (size == 0 or size >= sizeof(number)) {
+        return false;
+    }
+    std::memcpy(number, text, size);
+    number[size] = '\0';
+    char* end;
+    double value = std::strtod(number, &end);
+    if (end != number + size or not std::isfinite(value)) {
+        return false;
+    }
+    for (int precision = digits == 0 ? 15 : digits; precision <= 17; precision++) {
+        std::snprintf(number, sizeof(number), "%.*e", precision - 1, value);
+        if (digits != 0 or std::strtod(number, nullptr) == value) {
+            break;
+        }
+    }
+    // "%e" writes [-]d.ddde[+-]dd
+    negative = number[0] == '-';
+    const char* mantissa = number + negative;
+    nb_digits = 0;
+    for (const char* it = mantissa; *it != 'e'; it++) {
+        if (*it != '.') {
+            result[nb_digits++] = *it;
+        }
+    }
+    while (nb_digits > 0 and result[nb_digits - 1] == '0') {
+        nb_digits--;
+    }
+    exponent = std::atoi(std::strchr(mantissa, 'e') + 1);
+    append_decimal(out, negative, result, nb_digits, exponent);
+    return true;
+}
+
+// text that the ranges of tree point into, once checked that the tree can be written
+const char* checked_text(const DoubleListAnnotatedTree& tree) {
+    tree.check_finalized(tree.root());
+    return tree.text_.data();
+}
+
+const char* checked_text(const MappedAnnotatedTree& tree) {
+    tree.check_node(tree.root());
+    return tree.text_;
+}
+
+const int* data_of(const ArenaVector<int>& ints) { return ints.data(); }
+const int* data_of(const int* ints) { return ints; }
+
+// Writes tree, a DoubleListAnnotatedTree or a MappedAnnotatedTree, in NHX. Subtrees may be copied
+// from source, the same tree if it is a DoubleListAnnotatedTree (see copy_source).
+template <class Tree, class Flush>
+void write_tree(const Tree& tree, const DoubleListAnnotatedTree* source,
+                const NHXWriterOptions& options, std::string& buffer, std::size_t flush_size,
+                Flush flush) {
+    using TextRange = DoubleListAnnotatedTree::TextRange;
+    const char* text = checked_text(tree);
+    auto text_less = [&](const TextRange& a, const TextRange& b) {
+        int order = std::memcmp(text + a.offset, text + b.offset, std::min(a.size, b.size));
+        return order < 0 or (order == 0 and a.size < b.size);
+    };
+    auto selected = [&](int column) {
+        if (column == -1) {
+            return false;
+        }
+        std::string key = tree.text(tree.columns_[column].key);
+        const auto &include = options.include_tags, &exclude = options.exclude_tags;
+        return (include.empty() or std::find(include.begin(), include.end(), key) != include.end())
+               and std::find(exclude.begin(), exclude.end(), key) == exclude.end();
+    };
+    int name = tree.find_column("name", 4), length = tree.find_column("length", 6);
+    std::vector<int> tags;  // columns written in the NHX comment, in order
+    for (int column = 0; column < int(tree.nb_columns_) and options.nhx_tags; column++) {
+        if (column != name and column != length and selected(column)) {
+            tags.push_back(column);
+        }
+    }
+    name = selected(name) ? name : -1;
+    length = selected(length) ? length : -1;
+    if (options.sorted_tags) {
+        std::sort(tags.begin(), tags.end(), [&](int a, int b) {
+            return text_less(tree.columns_[a].key, tree.columns_[b].key);
+        });
+    }
+    auto find_value = [&](int column, int node) -> const TextRange* {
+        const TextRange* value = tree.find_value(column, node);
+        return value != nullptr and (value->size != 0 or not options.sorted_tags) ? value
+                                                                                 : nullptr;
+    };
+    auto append = [&](const TextRange& range) { buffer.append(text + range.offset, range.size); };
+    auto write_node = [&](int node, bool leaf) {
+        if (leaf or options.internal_names) {
+            if (const TextRange* value = find_value(name, node)) {
+                append(*value);
             }
-            next_token = Token{token_regex.first, m[0]};
-            it += std::string(m[0]).size();
-            // std::cout << "found token " << m[0] << std::endl;
-            return;
         }
-        token_number++;
+        if (const TextRange* value = find_value(length, node)) {
+            buffer += ':';
+            if (options.length_digits < 0 or
+                not append_number(buffer, text + value->offset, value->size,
+                                  options.length_digits)) {
+                append(*value);
+            }
+        }
+        bool nhx = false;
+        for (auto column : tags) {
+            if (const TextRange* value = find_value(column, node)) {
+                buffer += nhx ? ":" : "[&&NHX:";
+                nhx = true;
+                append(tree.columns_[column].key);
+                buffer += '=';
+                append(*value);
+            }
+        }
+        if (nhx) {
+            buffer += ']';
+        }
+        if (buffer.size() > flush_size) {
+            flush(buffer);
+        }
+    };
+
+    const int* offsets = data_of(tree.child_offsets_);
+    const int* children = data_of(tree.child_list_);
+    std::vector<int> sorted_children;
+    if (options.sorted_children) {
+        std::vector<std::uint64_t> hashes = tree.subtree_hashes();
+        sorted_children.assign(children, children + offsets[tree.nb_nodes()]);
+        for (std::size_t node = 0; node < tree.nb_nodes(); node++) {
+            std::sort(sorted_children.begin() + offsets[node],
+                      sorted_children.begin() + offsets[node + 1],
+                      [&](int a, int b) { return hashes[a] < hashes[b]; });
+        }
+        children = sorted_children.data();
+    }
+
+    // subtrees left as they were parsed are copied from the source when the output would otherwise
+    // only differ by spacing, comments or the order of tags
+    bool copy_source = options.copy_source and source != nullptr and
+                       source->source_ != nullptr and not options.sorted_tags and
+                       not options.sorted_children and options.include_tags.empty() and
+                       options.exclude_tags.empty() and options.nhx_tags and
+                       options.internal_names and options.length_digits < 0;
+
+    // each element is a node being written and the position in children of its next child
+    std::vector<std::pair<int, int>> stack;
+    auto open = [&](int node) {
+        if (copy_source and not source->is_modified(node)) {
+            const TextRange& span = source->spans_[node];
+            buffer.append(source->source_ + span.offset, span.size);
+            if (buffer.size() > flush_size) {
+                flush(buffer);
+            }
+        } else if (offsets[node] == offsets[node + 1]) {
+            write_node(node, true);
+        } else {
+            buffer += '(';
+            stack.emplace_back(node, offsets[node]);
+        }
+    };
+    open(tree.root());
+    while (not stack.empty()) {
+        int node = stack.back().first, next = stack.back().second;
+        if (next < offsets[node + 1]) {
+            if (next > offsets[node]) {
+                buffer += ',';
+            }
+            stack.back().second++;
+            open(children[next]);
+        } else {
+            buffer += ')';
+            stack.pop_back();
+            write_node(node, false);
+        }
+    }
+    buffer += ';';
+}
+}  // namespace
+
+void DoubleListAnnotatedTree::append_nhx(std::string& out,
+                                         const NHXWriterOptions& options) const {
+    write_tree(*this, this, options, out, std::string::npos, [](std::string&) {});
+}
+
+void DoubleListAnnotatedTree::write_nhx(std::ostream& out,
+                                        const NHXWriterOptions& options) const {
+    std::string buffer;
+    buffer.reserve(write_chunk_size + 256);
+    auto flush = [&](std::string& chunk) {
+        out.write(chunk.data(), chunk.size());
+        chunk.clear();
+    };
+    write_tree(*this, this, options, buffer, write_chunk_size, flush);
+    flush(buffer);
+}
+
+void DoubleListAnnotatedTree::write_nhx(int fd, const NHXWriterOptions& options) const {
+    std::string buffer;
+    buffer.reserve(write_chunk_size + 256);
+    auto flush = [&](std::string& chunk) {
+        const char* data = chunk.data();
+        std::size_t size = chunk.size();
+        while (size != 0) {
+            ssize_t written = ::write(fd, data, size);
+            if (written == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(std::string("Error: could not write NHX: ") +
+                                         std::strerror(errno));
+            }
+            data += written;
+            size -= written;
+        }
+        chunk.clear();
+    };
+    write_tree(*this, this, options, buffer, write_chunk_size, flush);
+    flush(buffer);
+}
+
+void MappedAnnotatedTree::append_nhx(std::string& out, const NHXWriterOptions& options) const {
+    write_tree(*this, nullptr, options, out, std::string::npos, [](std::string&) {});
+}
+
+/*================================================================================================*/
+// Binary trees. A file is a BinaryHeader, then the arrays of the tree, each at an 8-byte aligned
+// offset from the start given in the header (columns point to their own arrays). Numbers are in
+// native byte order, which byte_order checks; version changes with any change of layout.
+namespace {
+const char binary_magic[8] = {'N', 'H', 'X', 'T', 'R', 'E', 'E', '\0'};
+const std::uint32_t binary_version = 1, binary_byte_order = 0x01020304;
+
+struct BinaryHeader {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t byte_order;
+    std::uint64_t nb_nodes, root, preorder, nb_leaves, text_size, nb_columns;
+    // offsets of the arrays: nb_nodes parents, nb_nodes + 1 child offsets, nb_nodes - 1 children,
+    // nb_nodes subtree sizes, nb_leaves leaves, nb_nodes first leaves and leaf ends, text_size
+    // characters and nb_columns columns
+    std::uint64_t parent, child_offsets, child_list, subtree_size, leaves, first_leaf, leaf_end,
+        text, columns;
+};
+
+struct BinaryColumn {
+    std::uint64_t key_offset, key_size, encoded;
+    std::uint64_t present, present_size;  // 64-bit words
+    std::uint64_t values, values_size;    // TextRange, or 32-bit codes if encoded
+    std::uint64_t dictionary, dictionary_size;
+};
+
+static_assert(sizeof(DoubleListAnnotatedTree::TextRange) == 16, "TextRange is two 64-bit numbers");
+
+// appends size bytes of data to out at an 8-byte aligned offset from start and returns that offset
+std::uint64_t append_section(std::string& out, std::size_t start, const void* data,
+                             std::size_t size) {
+    out.append((8 - (out.size() - start) % 8) % 8, '\0');
+    std::uint64_t offset = out.size() - start;
+    out.append(static_cast<const char*>(data), size);
+    return offset;
+}
+}  // namespace
+
+void DoubleListAnnotatedTree::append_binary(std::string& out) const {
+    if (not finalized_) {
+        throw std::logic_error("tree is not finalized");
+    }
+    std::size_t start = out.size(), nb_nodes = parent_.size();
+    BinaryHeader header;
+    std::memcpy(header.magic, binary_magic, sizeof(binary_magic));
+    header.version = binary_version;
+    header.byte_order = binary_byte_order;
+    header.nb_nodes = nb_nodes;
+    header.root = root_;
+    header.preorder = preorder_;
+    header.nb_leaves = leaves_.size();
+    header.text_size = text_.size();
+    header.nb_columns = nb_columns_;
+    std::size_t size = sizeof(header) + text_.size() + (7 * nb_nodes + 16) * sizeof(int);
+    for (std::size_t i = 0; i < nb_columns_; i++) {
+        size += columns_[i].present.size() * 8 + columns_[i].values.size() * 16 +
+                columns_[i].codes.size() * 4 + columns_[i].dictionary.size() * 16 + 4 * 8;
+    }
+    out.reserve(start + size + sizeof(BinaryColumn) * nb_columns_);
+    out.append(sizeof(header), '\0');  // written last
+    auto append = [&](const void* data, std::size_t size) {
+        return append_section(out, start, data, size);
+    };
+    auto append_ints = [&](const ArenaVector<int>& ints) {
+        return append(ints.data(), ints.size() * sizeof(int));
+    };
+    header.parent = append_ints(parent_);
+    header.child_offsets = append_ints(child_offsets_);
+    header.child_list = append_ints(child_list_);
+    header.subtree_size = append_ints(subtree_size_);
+    header.leaves = append_ints(leaves_);
+    header.first_leaf = append_ints(first_leaf_);
+    header.leaf_end = append_ints(leaf_end_);
+    header.text = append(text_.data(), text_.size());
+    std::vector<BinaryColumn> columns(nb_columns_);
+    for (std::size_t i = 0; i < nb_columns_; i++) {
+        const TagColumn& column = columns_[i];
+        BinaryColumn& binary = columns[i];
+        binary.key_offset = column.key.offset;
+        binary.key_size = column.key.size;
+        binary.encoded = column.encoded;
+        binary.present = append(column.present.data(), column.present.size() * 8);
+        binary.present_size = column.present.size();
+        if (column.encoded) {
+            binary.values = append(column.codes.data(), column.codes.size() * 4);
+            binary.values_size = column.codes.size();
+        } else {
+            binary.values = append(column.values.data(), column.values.size() * 16);
+            binary.values_size = column.values.size();
+        }
+        binary.dictionary = append(column.dictionary.data(), column.dictionary.size() * 16);
+        binary.dictionary_size = column.dictionary.size();
+    }
+    header.columns = append(columns.data(), columns.size() * sizeof(BinaryColumn));
+    std::memcpy(&out[start], &header, sizeof(header));
+}
+
+void DoubleListAnnotatedTree::write_binary(std::ostream& out) const {
+    std::string buffer;
+    append_binary(buffer);
+    out.write(buffer.data(), buffer.size());
+}
+
+MappedAnnotatedTree::MappedAnnotatedTree(const char* data, std::size_t size) {
+    auto error = [](const std::string& message) {
+        return std::runtime_error("Error: not a binary tree: " + message);
+    };
+    BinaryHeader header;
+    if (size < sizeof(header) or std::memcmp(data, binary_magic, sizeof(binary_magic)) != 0) {
+        throw error("no header");
+    } else if (reinterpret_cast<std::uintptr_t>(data) % 8 != 0) {
+        throw std::invalid_argument("binary tree data is not 8-byte aligned");
+    }
+    std::memcpy(&header, data, sizeof(header));
+    if (header.version != binary_version) {
+        throw error("unsupported version " + std::to_string(header.version));
+    } else if (header.byte_order != binary_byte_order) {
+        throw error("written with another byte order");
+    } else if (header.nb_nodes >= std::uint64_t(1) << 31 or
+               (header.nb_nodes != 0 and header.root >= header.nb_nodes)) {
+        throw error("invalid number of nodes");
+    }
+    // pointer to an array of count elements of type T at offset, which must fit in data
+    auto section = [&](std::uint64_t offset, std::uint64_t count, std::size_t element_size) {
+        if (offset % 8 != 0 or offset > size or count > (size - offset) / element_size) {
+            throw error("truncated or invalid section");
+        }
+        return data + offset;
+    };
+    std::uint64_t nb_nodes = header.nb_nodes;
+    auto ints = [&](std::uint64_t offset, std::uint64_t count) {
+        return reinterpret_cast<const int*>(section(offset, count, sizeof(int)));
+    };
+    nb_nodes_ = nb_nodes;
+    root_ = header.root;
+    preorder_ = header.preorder != 0;
+    parent_ = ints(header.parent, nb_nodes);
+    child_offsets_ = ints(header.child_offsets, nb_nodes + 1);
+    child_list_ = ints(header.child_list, nb_nodes - (nb_nodes != 0));
+    subtree_size_ = ints(header.subtree_size, nb_nodes);
+    leaves_ = ints(header.leaves, header.nb_leaves);
+    first_leaf_ = ints(header.first_leaf, nb_nodes);
+    leaf_end_ = ints(header.leaf_end, nb_nodes);
+    text_ = section(header.text, header.text_size, 1);
+    text_size_ = header.text_size;
+    auto columns = reinterpret_cast<const BinaryColumn*>(
+        section(header.columns, header.nb_columns, sizeof(BinaryColumn)));
+    for (std::uint64_t i = 0; i < header.nb_columns; i++) {
+        const BinaryColumn& binary = columns[i];
+        if (binary.key_offset > header.text_size or
+            binary.key_size > header.text_size - binary.key_offset or
+            binary.present_size > (nb_nodes + 63) / 64 or binary.values_size > nb_nodes) {
+            throw error("invalid column");
+        }
+        Column column;
+        column.key = TextRange{std::size_t(binary.key_offset), std::size_t(binary.key_size)};
+        column.encoded = binary.encoded != 0;
+        column.present = reinterpret_cast<const std::uint64_t*>(
+            section(binary.present, binary.present_size, 8));
+        column.present_size = binary.present_size;
+        const char* values = section(binary.values, binary.values_size, column.encoded ? 4 : 16);
+        column.values = reinterpret_cast<const TextRange*>(values);
+        column.codes = reinterpret_cast<const std::uint32_t*>(values);
+        column.values_size = binary.values_size;
+        column.dictionary = reinterpret_cast<const TextRange*>(
+            section(binary.dictionary, binary.dictionary_size, 16));
+        column.dictionary_size = binary.dictionary_size;
+        columns_.push_back(column);
+    }
+    nb_columns_ = columns_.size();
+
+    // The contents must be a tree whose nodes are listed after their parent (see add_node), with
+    // leaves and tag values within their sections, so that no index read later is out of range.
+    auto check = [&](bool valid, const std::string& what) {
+        if (not valid) {
+            throw error("invalid " + what);
+        }
+    };
+    int n = nb_nodes, nb_leaves = header.nb_leaves;
+    check(child_offsets_[0] == 0 and child_offsets_[n] == std::max(n - 1, 0), "children");
+    for (int node = 0; node < n; node++) {
+        check(child_offsets_[node] <= child_offsets_[node + 1], "children");
+    }
+    for (int node = 0; node < n; node++) {
+        check(node == root_ ? parent_[node] == -1 : parent_[node] >= 0 and parent_[node] < n,
+              "parents");
+        for (int i = child_offsets_[node]; i < child_offsets_[node + 1]; i++) {
+            int child = child_list_[i];
+            check(child > node and child < n and parent_[child] == node, "children");
+        }
+        check(subtree_size_[node] >= 1 and subtree_size_[node] <= n - node, "subtree sizes");
+        check(first_leaf_[node] >= 0 and first_leaf_[node] <= leaf_end_[node] and
+                  leaf_end_[node] <= nb_leaves,
+              "leaves");
+    }
+    for (int i = 0; i < nb_leaves; i++) {
+        check(leaves_[i] >= 0 and leaves_[i] < n, "leaves");
+    }
+    auto in_text = [&](const TextRange& range) {
+        return range.offset <= text_size_ and range.size <= text_size_ - range.offset;
+    };
+    for (const Column& column : columns_) {
+        for (std::size_t i = 0; i < column.dictionary_size; i++) {
+            check(in_text(column.dictionary[i]), "tag values");
+        }
+        for (int node = 0; node < n; node++) {
+            if (column.has(node)) {
+                check(std::size_t(node) < column.values_size and
+                          (column.encoded ? column.codes[node] < column.dictionary_size
+                                          : in_text(column.values[node])),
+                      "tag values");
+            }
+        }
+    }
+}
+
+MappedAnnotatedTree::MappedAnnotatedTree(MappedFile file)
+    : MappedAnnotatedTree(file.data(), file.size()) {
+    file_ = std::move(file);
+}
+
+DoubleListAnnotatedTree MappedAnnotatedTree::to_tree() const {
+    DoubleListAnnotatedTree tree;
+    auto copy = [&](ArenaVector<int>& to, const int* from, std::size_t size) {
+        to.assign(from, from + size);
+    };
+    copy(tree.parent_, parent_, nb_nodes_);
+    copy(tree.child_offsets_, child_offsets_, nb_nodes_ + 1);
+    copy(tree.child_list_, child_list_, nb_nodes_ - (nb_nodes_ != 0));
+    copy(tree.subtree_size_, subtree_size_, nb_nodes_);
+    copy(tree.leaves_, leaves_, nb_nodes_ != 0 ? leaf_end_[root_] - first_leaf_[root_] : 0);
+    copy(tree.first_leaf_, first_leaf_, nb_nodes_);
+    copy(tree.leaf_end_, leaf_end_, nb_nodes_);
+    tree.root_ = root_;
+    tree.preorder_ = preorder_;
+    tree.finalized_ = true;
+    tree.text_.assign(text_, text_size_);
+    for (const Column& column : columns_) {
+        tree.columns_.emplace_back(nullptr);
+        DoubleListAnnotatedTree::TagColumn& copy = tree.columns_.back();
+        copy.key = column.key;
+        copy.encoded = column.encoded;
+        copy.present.assign(column.present, column.present + column.present_size);
+        if (column.encoded) {
+            copy.codes.assign(column.codes, column.codes + column.values_size);
+        } else {
+            copy.values.assign(column.values, column.values + column.values_size);
+        }
+        copy.dictionary.assign(column.dictionary, column.dictionary + column.dictionary_size);
+        // slots are built by intern when a value is next added
+    }
+    tree.nb_columns_ = columns_.size();
+    return tree;
+}
+
+/*================================================================================================*/
+// Canonical forms of trees, for equality and hashing. Two subtrees are equal when their roots have
+// the same tags and their children can be matched one to one with equal subtrees, so each subtree
+// gets a class computed from the tags of its root and the sorted classes of its children (AHU
+// algorithm).
+namespace {
+std::uint64_t mix(std::uint64_t x) {  // splitmix64 finalizer
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+// Gives consecutive ids to distinct values, which are kept by value and compared with ==.
+template <class Value, class Hash>
+class IdTable {
+    std::vector<Value> values_;
+    std::vector<int> slots_;  // open addressing: id + 1 of the value hashed there (0 if empty)
+    Hash hash_;
+
+  public:
+    std::size_t size() const { return values_.size(); }
+
+    int id(const Value& value) {
+        if ((values_.size() + 1) * 2 > slots_.size()) {  // grow the hash table
+            slots_.assign(std::max(std::size_t(16), slots_.size() * 2), 0);
+            for (std::size_t id = 0; id < values_.size(); id++) {
+                std::size_t slot = hash_(values_[id]);
+                while (slots_[slot &= slots_.size() - 1] != 0) {
+                    slot++;
+                }
+                slots_[slot] = id + 1;
+            }
+        }
+        std::size_t slot = hash_(value);
+        while (slots_[slot &= slots_.size() - 1] != 0) {
+            if (values_[slots_[slot] - 1] == value) {
+                return slots_[slot] - 1;
+            }
+            slot++;
+        }
+        values_.push_back(value);
+        slots_[slot] = values_.size();
+        return values_.size() - 1;
+    }
+};
+
+struct StringViewHash {
+    std::size_t operator()(StringView s) const {
+        return mix(DoubleListAnnotatedTree::hash_text(s.data(), s.size()));
+    }
+};
+
+// nodes of tree, parents before children (in index order if nodes are numbered in preorder)
+std::vector<int> parents_first(const AnnotatedTree& tree) {
+    std::vector<int> order;
+    order.reserve(tree.nb_nodes());
+    if (tree.is_preorder()) {
+        for (std::size_t node = 0; node < tree.nb_nodes(); node++) {
+            order.push_back(node);
+        }
+        return order;
+    }
+    order.push_back(tree.root());  // breadth-first
+    for (std::size_t k = 0; k < order.size(); k++) {
+        for (auto child : tree.children(order[k])) {
+            order.push_back(child);
+        }
+    }
+    return order;
+}
+
+// a subtree class: a slice of the signature buffer of CanonicalClasses
+struct Signature {
+    const std::vector<int>* buffer;
+    std::size_t begin, end;
+    bool operator==(const Signature& other) const {
+        return end - begin == other.end - other.begin and
+               std::equal(buffer->begin() + begin, buffer->begin() + end,
+                          other.buffer->begin() + other.begin);
+    }
+};
+
+struct SignatureHash {
+    std::size_t operator()(const Signature& s) const {
+        std::uint64_t hash = s.end - s.begin;
+        for (std::size_t i = s.begin; i < s.end; i++) {
+            hash = mix(hash ^ std::uint32_t((*s.buffer)[i]));
+        }
+        return hash;
+    }
+};
+
+// Classes of the subtrees of any number of trees, compared on the values of a fixed list of tags.
+// Signatures (tag value ids, then sorted child classes) are stored back to back in one buffer.
+class CanonicalClasses {
+    std::vector<std::string> keys_;
+    std::vector<IdTable<StringView, StringViewHash>> values_;  // value ids, one table per key
+    std::vector<int> signatures_;
+    IdTable<Signature, SignatureHash> classes_;
+
+  public:
+    explicit CanonicalClasses(std::vector<std::string> keys)
+        : keys_(std::move(keys)), values_(keys_.size()) {}
+
+    // Computes the class of the subtree of each node of tree (values of tree must outlive this
+    // object). If known_only, stops and returns false at the first subtree of a new class.
+    bool classify(const AnnotatedTree& tree, std::vector<int>& result, bool known_only = false) {
+        std::vector<int> tag_ids;
+        for (auto& key : keys_) {
+            tag_ids.push_back(tree.tag_id(key));
+        }
+        std::vector<int> order = parents_first(tree);
+        result.assign(tree.nb_nodes(), 0);
+        for (std::size_t k = order.size(); k-- > 0;) {
+            int node = order[k];
+            std::size_t begin = signatures_.size();
+            for (std::size_t i = 0; i < tag_ids.size(); i++) {
+                signatures_.push_back(
+                    values_[i].id(tag_ids[i] != -1 ? tree.tag(node, tag_ids[i]) : StringView()));
+            }
+            std::size_t children_begin = signatures_.size();
+            for (auto child : tree.children(node)) {
+                signatures_.push_back(result[child]);
+            }
+            std::sort(signatures_.begin() + children_begin, signatures_.end());
+            std::size_t nb_classes = classes_.size();
+            result[node] = classes_.id(Signature{&signatures_, begin, signatures_.size()});
+            if (classes_.size() == nb_classes) {  // known class: drop the copy
+                signatures_.resize(begin);
+            } else if (known_only) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// Hashes of the subtrees of tree, whose tag ids are the indices of keys. A node hashes its tags
+// (summed, so that their order does not matter), then its sorted child hashes; parents must have
+// smaller indices than their children (see DoubleListAnnotatedTree::add_node).
+std::vector<std::uint64_t> hash_subtrees(const AnnotatedTree& tree,
+                                         const std::vector<StringView>& keys) {
+    std::vector<std::uint64_t> hashes(tree.nb_nodes());
+    std::vector<std::uint64_t> child_hashes;
+    for (std::size_t node = tree.nb_nodes(); node-- > 0;) {
+        std::uint64_t tags = 0;
+        for (std::size_t id = 0; id < keys.size(); id++) {
+            StringView value = tree.tag(node, id);
+            if (not value.empty()) {
+                tags += mix(DoubleListAnnotatedTree::hash_text(keys[id].data(), keys[id].size()) ^
+                            mix(DoubleListAnnotatedTree::hash_text(value.data(), value.size())));
+            }
+        }
+        child_hashes.clear();
+        for (auto child : tree.children(node)) {
+            child_hashes.push_back(hashes[child]);
+        }
+        std::sort(child_hashes.begin(), child_hashes.end());
+        std::uint64_t hash = mix(tags + child_hashes.size());
+        for (auto child_hash : child_hashes) {
+            hash = mix(hash ^ child_hash);
+        }
+        hashes[node] = hash;
+    }
+    return hashes;
+}
+
+// tree == other, comparing the values of keys (see DoubleListAnnotatedTree::operator==)
+bool equal_trees(const AnnotatedTree& tree, std::vector<std::string> keys,
+                 const AnnotatedTree& other) {
+    if (tree.nb_nodes() != other.nb_nodes()) {
+        return false;
+    } else if (tree.nb_nodes() == 0) {
+        return true;
+    }
+    // every subtree of other must be like one of tree, so stop at the first one that is not
+    CanonicalClasses classes(std::move(keys));
+    std::vector<int> tree_classes, other_classes;
+    classes.classify(tree, tree_classes);
+    return classes.classify(other, other_classes, true) and
+           other_classes[other.root()] == tree_classes[tree.root()];
+}
+}  // namespace
+
+std::vector<std::uint64_t> DoubleListAnnotatedTree::subtree_hashes() const {
+    if (not finalized_) {
+        throw std::logic_error("tree is not finalized");
+    }
+    std::vector<StringView> keys;
+    for (std::size_t column = 0; column < nb_columns_; column++) {
+        keys.emplace_back(text_.data() + columns_[column].key.offset, columns_[column].key.size);
+    }
+    return hash_subtrees(*this, keys);
+}
+
+std::uint64_t DoubleListAnnotatedTree::canonical_hash() const {
+    return nb_nodes() != 0 ? subtree_hashes()[root_] : 0;
+}
+
+bool DoubleListAnnotatedTree::operator==(const AnnotatedTree& other) const {
+    std::vector<std::string> keys;
+    for (std::size_t column = 0; column < nb_columns_; column++) {
+        keys.push_back(text(columns_[column].key));
+    }
+    return equal_trees(*this, std::move(keys), other);
+}
+
+std::vector<std::uint64_t> MappedAnnotatedTree::subtree_hashes() const {
+    std::vector<StringView> keys;
+    for (const Column& column : columns_) {
+        keys.emplace_back(text_ + column.key.offset, column.key.size);
+    }
+    return hash_subtrees(*this, keys);
+}
+
+std::uint64_t MappedAnnotatedTree::canonical_hash() const {
+    return nb_nodes_ != 0 ? subtree_hashes()[root_] : 0;
+}
+
+bool MappedAnnotatedTree::operator==(const AnnotatedTree& other) const {
+    std::vector<std::string> keys;
+    for (const Column& column : columns_) {
+        keys.push_back(text(column.key));
+    }
+    return equal_trees(*this, std::move(keys), other);
+}
+
+/*================================================================================================*/
+// Robinson-Foulds distance. Both trees are rerooted at the same leaf, so that the splits of each
+// tree are the leaf sets below its nodes (clusters). Leaves are numbered in depth-first order of
+// the first tree, where its clusters are intervals that Day's table finds in constant time.
+namespace {
+// a tree seen as unrooted, traversed from one of its leaves
+struct RerootedTree {
+    std::vector<int> order;   // preorder from the new root
+    std::vector<int> parent;  // indexed by node, -1 for the new root
+
+    RerootedTree(const AnnotatedTree& tree, AnnotatedTree::NodeIndex root)
+        : parent(tree.nb_nodes(), -1) {
+        std::vector<int> stack{root};
+        while (not stack.empty()) {
+            int node = stack.back();
+            stack.pop_back();
+            order.push_back(node);
+            // neighbors are the children and the parent, except the node we come from
+            std::size_t nb_stacked = stack.size();
+            int old_parent = tree.parent(node);
+            if (old_parent != -1 and old_parent != parent[node]) {
+                stack.push_back(old_parent);
+            }
+            for (auto child : tree.children(node)) {
+                if (child != parent[node]) {
+                    stack.push_back(child);
+                }
+            }
+            std::reverse(stack.begin() + nb_stacked, stack.end());
+            for (std::size_t i = nb_stacked; i < stack.size(); i++) {
+                parent[stack[i]] = node;
+            }
+        }
+    }
+};
+
+// Cluster of each node: the interval [low, high] of the numbers of the count leaves below it, and
+// the number of children that have leaves below them (nodes with fewer than two only repeat the
+// cluster of a child). number[node] is the number of the leaves (-1 for other nodes).
+struct Clusters {
+    std::vector<int> low, high, count, nb_children;
+
+    Clusters(const RerootedTree& tree, const std::vector<int>& number)
+        : low(number.size(), INT32_MAX), high(number.size(), -1), count(number.size(), 0),
+          nb_children(number.size(), 0) {
+        for (std::size_t k = tree.order.size(); k-- > 0;) {
+            int node = tree.order[k], parent = tree.parent[node];
+            if (number[node] != -1) {
+                low[node] = high[node] = number[node];
+                count[node] = 1;
+            }
+            if (parent != -1 and count[node] != 0) {
+                low[parent] = std::min(low[parent], low[node]);
+                high[parent] = std::max(high[parent], high[node]);
+                count[parent] += count[node];
+                nb_children[parent]++;
+            }
+        }
+    }
+
+    // whether node has a nontrivial split out of nb_leaves leaves
+    bool is_split(int node, std::size_t nb_leaves) const {
+        return nb_children[node] >= 2 and count[node] >= 2 and
+               std::size_t(count[node]) + 2 <= nb_leaves;
+    }
+};
+
+StringView node_name(const AnnotatedTree& tree, AnnotatedTree::TagId name,
+                     AnnotatedTree::NodeIndex node) {
+    return name != -1 ? tree.tag(node, name) : StringView();
+}
+
+std::vector<int> tree_leaves(const AnnotatedTree& tree) {
+    if (tree.nb_nodes() == 0) {
+        return std::vector<int>();
+    }
+    auto leaves = tree.leaves(tree.root());
+    return std::vector<int>(leaves.begin(), leaves.end());
+}
+}  // namespace
+
+RFDistance robinson_foulds(const AnnotatedTree& a, const AnnotatedTree& b) {
+    std::vector<int> a_leaves = tree_leaves(a), b_leaves = tree_leaves(b);
+    std::size_t nb_leaves = a_leaves.size();
+    if (b_leaves.size() != nb_leaves) {
+        throw std::invalid_argument("trees have " + std::to_string(nb_leaves) + " and " +
+                                    std::to_string(b_leaves.size()) + " leaves");
+    } else if (nb_leaves == 0) {
+        return RFDistance{0, 0};
+    }
+
+    // number the leaves of a in depth-first order from its first leaf, which gets the last number
+    auto a_name = a.tag_id("name"), b_name = b.tag_id("name");
+    RerootedTree a_rerooted(a, a_leaves[0]);
+    std::vector<int> a_number(a.nb_nodes(), -1);
+    std::unordered_map<StringView, int, StringViewHash> numbers(2 * nb_leaves);
+    int next_number = 0;
+    for (auto node : a_rerooted.order) {
+        if (a.children(node).empty()) {
+            int number = node == a_leaves[0] ? nb_leaves - 1 : next_number++;
+            if (not numbers.emplace(node_name(a, a_name, node), number).second) {
+                throw std::invalid_argument("leaf name " + node_name(a, a_name, node).str() +
+                                            " is not unique");
+            }
+            a_number[node] = number;
+        }
+    }
+
+    // Day's table: a split of a is stored at row high if it has the same low end as the nearest
+    // cluster containing it, at row low otherwise (no two splits of a share a row)
+    Clusters a_clusters(a_rerooted, a_number);
+    std::vector<std::pair<int, int>> table(nb_leaves, std::make_pair(-1, -1));
+    std::vector<int> enclosing_low(a.nb_nodes(), 0);
+    std::size_t a_splits = 0;
+    for (auto node : a_rerooted.order) {
+        int parent = a_rerooted.parent[node];
+        if (parent != -1) {
+            bool same_cluster = a_clusters.count[node] == a_clusters.count[parent];
+            enclosing_low[node] = same_cluster ? enclosing_low[parent] : a_clusters.low[parent];
+        }
+        if (parent != -1 and a_clusters.is_split(node, nb_leaves)) {
+            int low = a_clusters.low[node], high = a_clusters.high[node];
+            table[enclosing_low[node] == low ? high : low] = std::make_pair(low, high);
+            a_splits++;
+        }
+    }
+
+    // number the leaves of b like those of a, and look its splits up
+    std::vector<int> b_number(b.nb_nodes(), -1);
+    std::vector<bool> seen(nb_leaves, false);
+    int b_root = -1;
+    for (auto node : b_leaves) {
+        auto it = numbers.find(node_name(b, b_name, node));
+        if (it == numbers.end() or seen[it->second]) {
+            throw std::invalid_argument("leaf name " + node_name(b, b_name, node).str() +
+                                        (it == numbers.end() ? " is only in the second tree"
+                                                             : " is not unique"));
+        }
+        seen[it->second] = true;
+        b_number[node] = it->second;
+        if (it->second == int(nb_leaves) - 1) {
+            b_root = node;
+        }
+    }
+    RerootedTree b_rerooted(b, b_root);
+    Clusters b_clusters(b_rerooted, b_number);
+    std::size_t b_splits = 0, shared = 0;
+    for (auto node : b_rerooted.order) {
+        if (b_rerooted.parent[node] != -1 and b_clusters.is_split(node, nb_leaves)) {
+            int low = b_clusters.low[node], high = b_clusters.high[node];
+            auto cluster = std::make_pair(low, high);
+            if (high - low + 1 == b_clusters.count[node] and
+                (table[low] == cluster or table[high] == cluster)) {
+                shared++;
+            }
+            b_splits++;
+        }
+    }
+
+    std::size_t distance = a_splits + b_splits - 2 * shared;
+    return RFDistance{distance, a_splits + b_splits != 0 ? double(distance) / (a_splits + b_splits)
+                                                         : 0.0};
+}
+
+/*================================================================================================*/
+// Split dictionary and all-pairs Robinson-Foulds distances
+SplitDictionary::SplitDictionary(const std::vector<std::string>& leaf_names) {
+    set_leaf_names(leaf_names);
+}
+
+void SplitDictionary::set_leaf_names(const std::vector<std::string>& leaf_names) {
+    std::size_t nb_slots = 16;
+    while (nb_slots < 2 * leaf_names.size()) {
+        nb_slots *= 2;
+    }
+    std::vector<int> slots(nb_slots, 0);
+    for (std::size_t leaf = 0; leaf < leaf_names.size(); leaf++) {
+        const std::string& name = leaf_names[leaf];
+        std::size_t slot = DoubleListAnnotatedTree::hash_text(name.data(), name.size());
+        while (slots[slot &= slots.size() - 1] != 0) {
+            if (leaf_names[slots[slot] - 1] == name) {
+                throw std::invalid_argument("leaf name " + name + " is not unique");
+            }
+            slot++;
+        }
+        slots[slot] = leaf + 1;
+    }
+    leaf_names_ = leaf_names;
+    leaf_slots_ = std::move(slots);
+    nb_words_ = (leaf_names.size() + 63) / 64;
+}
+
+int SplitDictionary::find_leaf(StringView name) const {
+    if (leaf_slots_.empty()) {
+        return -1;
+    }
+    std::size_t slot = DoubleListAnnotatedTree::hash_text(name.data(), name.size());
+    while (leaf_slots_[slot &= leaf_slots_.size() - 1] != 0) {
+        if (StringView(leaf_names_[leaf_slots_[slot] - 1]) == name) {
+            return leaf_slots_[slot] - 1;
+        }
+        slot++;
+    }
+    return -1;
+}
+
+int SplitDictionary::add_split(const std::uint64_t* split) {
+    auto hash = [this](const std::uint64_t* words) {
+        std::uint64_t result = 0;
+        for (std::size_t i = 0; i < nb_words_; i++) {
+            result = mix(result ^ words[i]);
+        }
+        return result;
+    };
+    if ((nb_splits_ + 1) * 2 > slots_.size()) {  // grow the hash table
+        slots_.assign(std::max(std::size_t(16), slots_.size() * 2), 0);
+        for (std::size_t id = 0; id < nb_splits_; id++) {
+            std::size_t slot = hash(splits_.data() + id * nb_words_);
+            while (slots_[slot &= slots_.size() - 1] != 0) {
+                slot++;
+            }
+            slots_[slot] = id + 1;
+        }
+    }
+    std::size_t slot = hash(split);
+    while (slots_[slot &= slots_.size() - 1] != 0) {
+        int id = slots_[slot] - 1;
+        if (std::equal(split, split + nb_words_, splits_.data() + id * nb_words_)) {
+            return id;
+        }
+        slot++;
+    }
+    splits_.insert(splits_.end(), split, split + nb_words_);
+    slots_[slot] = ++nb_splits_;
+    return nb_splits_ - 1;
+}
+
+std::vector<int> SplitDictionary::renumbering(const SplitDictionary& other) const {
+    std::vector<int> result;
+    for (auto& name : other.leaf_names_) {
+        int leaf = find_leaf(name);
+        if (leaf == -1 or other.nb_leaves() != nb_leaves()) {
+            throw std::invalid_argument("splits are not on the same leaf names");
+        }
+        result.push_back(leaf);
+    }
+    return result;
+}
+
+int SplitDictionary::add_split(const SplitDictionary& other, int split,
+                               const std::vector<int>& renumbering) {
+    std::vector<std::uint64_t> bits(nb_words_, 0);
+    for (std::size_t leaf = 0; leaf < renumbering.size(); leaf++) {
+        if (other.contains(split, leaf)) {
+            bits[renumbering[leaf] / 64] |= std::uint64_t(1) << (renumbering[leaf] % 64);
+        }
+    }
+    if (bits[0] & 1) {  // use the side without leaf 0
+        for (std::size_t leaf = 0; leaf < nb_leaves(); leaf++) {
+            bits[leaf / 64] ^= std::uint64_t(1) << (leaf % 64);
+        }
+    }
+    return add_split(bits.data());
+}
+
+std::vector<int> SplitDictionary::add(const AnnotatedTree& tree) {
+    auto name = tree.tag_id("name");
+    std::vector<int> leaves = tree_leaves(tree);
+    if (leaf_names_.empty()) {
+        std::vector<std::string> leaf_names;
+        for (auto leaf : leaves) {
+            leaf_names.push_back(node_name(tree, name, leaf));
+        }
+        set_leaf_names(leaf_names);
+    } else if (leaves.size() != leaf_names_.size()) {
+        throw std::invalid_argument("tree has " + std::to_string(leaves.size()) +
+                                    " leaves instead of " + std::to_string(leaf_names_.size()));
+    }
+
+    // leaves below each node, and how many
+    std::vector<std::uint64_t> below(tree.nb_nodes() * nb_words_, 0);
+    std::vector<std::size_t> count(tree.nb_nodes(), 0);
+    std::vector<std::uint64_t> seen(nb_words_, 0);
+    for (auto leaf : leaves) {
+        StringView label = node_name(tree, name, leaf);
+        int number = find_leaf(label);
+        std::uint64_t bit = std::uint64_t(1) << (number & 63);
+        if (number == -1 or (seen[number / 64] & bit)) {
+            throw std::invalid_argument("leaf name " + label.str() +
+                                        (number == -1 ? " is not in previous trees"
+                                                      : " is not unique"));
+        }
+        seen[number / 64] |= bit;
+        below[leaf * nb_words_ + number / 64] = bit;
+        count[leaf] = 1;
+    }
+    std::vector<int> order = parents_first(tree);
+
+    std::vector<int> result;
+    result.reserve(order.size());
+    std::size_t nb_leaves = leaf_names_.size();
+    std::uint64_t last_word_mask = nb_leaves % 64 != 0 ? (std::uint64_t(1) << (nb_leaves % 64)) - 1
+                                                       : ~std::uint64_t(0);
+    for (std::size_t k = order.size(); k-- > 1;) {
+        int node = order[k], parent = tree.parent(node);
+        std::uint64_t* split = &below[node * nb_words_];
+        for (std::size_t i = 0; i < nb_words_; i++) {
+            below[parent * nb_words_ + i] |= split[i];
+        }
+        count[parent] += count[node];
+        if (count[node] >= 2 and count[node] + 2 <= nb_leaves) {
+            if (split[0] & 1) {  // use the side without leaf 0
+                for (std::size_t i = 0; i < nb_words_; i++) {
+                    split[i] = ~split[i];
+                }
+                split[nb_words_ - 1] &= last_word_mask;
+            }
+            result.push_back(add_split(split));
+        }
+    }
+    // nodes with one child and roots with two repeat splits
+    std::sort(result.begin(), result.end());
+    result.erase(std::unique(result.begin(), result.end()), result.end());
+    return result;
+}
+
+namespace {
+// number of bits set in both a and b, which are nb_words long
+using CountCommon = std::size_t (*)(const std::uint64_t* a, const std::uint64_t* b,
+                                    std::size_t nb_words);
+
+std::size_t count_common_generic(const std::uint64_t* a, const std::uint64_t* b,
+                                 std::size_t nb_words) {
+    std::size_t result = 0;
+    for (std::size_t i = 0; i < nb_words; i++) {
+        result += __builtin_popcountll(a[i] & b[i]);
+    }
+    return result;
+}
+
+#ifdef NHX_X86_SIMD
+__attribute__((target("popcnt"))) std::size_t count_common_popcnt(const std::uint64_t* a,
+                                                                  const std::uint64_t* b,
+                                                                  std::size_t nb_words) {
+    std::size_t result = 0;
+    for (std::size_t i = 0; i < nb_words; i++) {
+        result += __builtin_popcountll(a[i] & b[i]);
+    }
+    return result;
+}
+
+// 4 words at a time, counting the bits of each half byte with a lookup table (Mula's algorithm)
+__attribute__((target("avx2,popcnt"))) std::size_t count_common_avx2(const std::uint64_t* a,
+                                                                    const std::uint64_t* b,
+                                                                    std::size_t nb_words) {
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, 0, 1,
+                                            1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_half = _mm256_set1_epi8(0x0f);
+    __m256i totals = _mm256_setzero_si256();
+    std::size_t i = 0;
+    for (; i + 4 <= nb_words; i += 4) {
+        __m256i x = _mm256_and_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i)),
+                                     _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i)));
+        __m256i counts = _mm256_add_epi8(
+            _mm256_shuffle_epi8(lookup, _mm256_and_si256(x, low_half)),
+            _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(x, 4), low_half)));
+        totals = _mm256_add_epi64(totals, _mm256_sad_epu8(counts, _mm256_setzero_si256()));
+    }
+    std::size_t result = _mm256_extract_epi64(totals, 0) + _mm256_extract_epi64(totals, 1) +
+                         _mm256_extract_epi64(totals, 2) + _mm256_extract_epi64(totals, 3);
+    for (; i < nb_words; i++) {
+        result += __builtin_popcountll(a[i] & b[i]);
+    }
+    return result;
+}
+#endif
+
+CountCommon select_count_common() {
+#ifdef NHX_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return count_common_avx2;
+    } else if (__builtin_cpu_supports("popcnt")) {
+        return count_common_popcnt;
+    }
+#endif
+    return count_common_generic;
+}
+
+// implementation for this CPU, chosen on first use (see classify_block)
+CountCommon count_common() {
+    static const CountCommon selected = select_count_common();
+    return selected;
+}
+}  // namespace
+
+RFMatrix robinson_foulds_matrix(const std::vector<DoubleListAnnotatedTree>& trees,
+                                unsigned nb_threads) {
+    std::size_t nb_trees = trees.size();
+    SplitDictionary dictionary;
+    std::vector<std::vector<int>> tree_splits;
+    for (auto& tree : trees) {
+        tree_splits.push_back(dictionary.add(tree));
+    }
+    RFMatrix result{nb_trees, std::vector<std::size_t>(nb_trees),
+                    std::vector<std::size_t>(nb_trees * nb_trees, 0)};
+    std::size_t nb_words = (dictionary.size() + 63) / 64;
+    std::vector<std::uint64_t> bitsets(nb_trees * nb_words, 0);  // splits of each tree
+    for (std::size_t i = 0; i < nb_trees; i++) {
+        result.nb_splits[i] = tree_splits[i].size();
+        for (auto split : tree_splits[i]) {
+            bitsets[i * nb_words + split / 64] |= std::uint64_t(1) << (split % 64);
+        }
+    }
+
+    // tiles of tile_size x tile_size trees above the diagonal, each taken by the next free thread
+    const std::size_t tile_size = 64;
+    std::size_t nb_tile_rows = (nb_trees + tile_size - 1) / tile_size;
+    std::vector<std::pair<std::size_t, std::size_t>> tiles;
+    for (std::size_t row = 0; row < nb_tile_rows; row++) {
+        for (std::size_t column = row; column < nb_tile_rows; column++) {
+            tiles.emplace_back(row * tile_size, column * tile_size);
+        }
+    }
+    const CountCommon count_shared = count_common();
+    std::atomic<std::size_t> next_tile{0};
+    run_workers(nb_workers(nb_threads, tiles.size()), [&](unsigned) {
+        std::size_t t;
+        while ((t = next_tile++) < tiles.size()) {
+            std::size_t row_end = std::min(tiles[t].first + tile_size, nb_trees);
+            std::size_t column_end = std::min(tiles[t].second + tile_size, nb_trees);
+            for (std::size_t i = tiles[t].first; i < row_end; i++) {
+                for (std::size_t j = std::max(tiles[t].second, i + 1); j < column_end; j++) {
+                    std::size_t shared = count_shared(&bitsets[i * nb_words],
+                                                      &bitsets[j * nb_words], nb_words);
+                    result.distances[i * nb_trees + j] = result.distances[j * nb_trees + i] =
+                        result.nb_splits[i] + result.nb_splits[j] - 2 * shared;
+                }
+            }
+        }
+    });
+    return result;
+}
+
+/*================================================================================================*/
+// Split frequencies
+void SplitFrequencies::merge(const SplitFrequencies& other) {
+    if (other.splits_.leaf_names().empty()) {  // no tree with leaves
+        nb_trees_ += other.nb_trees_;
+        return;
+    } else if (splits_.nb_leaves() == 0) {
+        splits_ = SplitDictionary(other.splits_.leaf_names());
+    }
+    bool same_numbering = splits_.leaf_names() == other.splits_.leaf_names();
+    std::vector<int> renumbering;
+    if (not same_numbering) {
+        renumbering = splits_.renumbering(other.splits_);
+    }
+    for (std::size_t split = 0; split < other.splits_.size(); split++) {
+        int id = same_numbering ? splits_.add_split(other.splits_.split(split))
+                                : splits_.add_split(other.splits_, split, renumbering);
+        counts_.resize(splits_.size(), 0);
+        counts_[id] += other.counts_[split];
+    }
+    nb_trees_ += other.nb_trees_;
+}
+
+SplitFrequencies count_splits(const char* data, std::size_t size, unsigned nb_threads,
+                              std::size_t burnin, const NHXParserOptions& options) {
+    std::vector<Slice> slices = locate_trees(data, size);
+    if (burnin >= slices.size()) {
+        return SplitFrequencies();
+    }
+    // the first tree gives the leaf numbering shared by all accumulators, so that merging them does
+    // not renumber leaves
+    std::vector<std::string> leaf_names;
+    TreeCollectionParser::parse(slices, burnin, burnin + 1, 1, options,
+                                [&](unsigned, std::size_t, DoubleListAnnotatedTree& tree) {
+                                    SplitDictionary dictionary;
+                                    dictionary.add(tree);
+                                    leaf_names = dictionary.leaf_names();
+                                });
+    std::vector<SplitFrequencies> counters(nb_workers(nb_threads, slices.size() - burnin),
+                                           SplitFrequencies(leaf_names));
+    TreeCollectionParser::parse(slices, burnin, slices.size(), counters.size(), options,
+                                [&](unsigned thread, std::size_t, DoubleListAnnotatedTree& tree) {
+                                    counters[thread].add(tree);
+                                });
+    for (std::size_t thread = 1; thread < counters.size(); thread++) {
+        counters[0].merge(counters[thread]);
+    }
+    return std::move(counters[0]);
+}
+
+double average_standard_deviation(const std::vector<SplitFrequencies>& chains,
+                                  double min_frequency) {
+    if (chains.size() < 2) {
+        throw std::invalid_argument("average standard deviation of split frequencies needs at "
+                                    "least two chains");
+    }
+    // ids of the splits of each chain in a dictionary of the splits of all chains
+    std::size_t nb_chains = chains.size();
+    SplitDictionary splits;
+    for (auto& chain : chains) {
+        if (splits.nb_leaves() == 0) {
+            splits = SplitDictionary(chain.splits().leaf_names());
+        }
+    }
+    std::vector<std::vector<int>> ids(nb_chains);
+    for (std::size_t chain = 0; chain < nb_chains; chain++) {
+        const SplitDictionary& chain_splits = chains[chain].splits();
+        if (chain_splits.nb_leaves() != 0) {
+            std::vector<int> renumbering = splits.renumbering(chain_splits);
+            for (std::size_t split = 0; split < chain_splits.size(); split++) {
+                ids[chain].push_back(splits.add_split(chain_splits, split, renumbering));
+            }
+        }
+    }
+    // frequency of split in chain at frequencies[split * nb_chains + chain]
+    std::vector<double> frequencies(splits.size() * nb_chains, 0.0);
+    for (std::size_t chain = 0; chain < nb_chains; chain++) {
+        for (std::size_t split = 0; split < ids[chain].size(); split++) {
+            frequencies[ids[chain][split] * nb_chains + chain] = chains[chain].frequency(split);
+        }
+    }
+
+    double total = 0;
+    std::size_t nb_splits = 0;
+    for (std::size_t split = 0; split < splits.size(); split++) {
+        const double* begin = &frequencies[split * nb_chains];
+        const double* end = begin + nb_chains;
+        if (*std::max_element(begin, end) >= min_frequency) {
+            double mean = std::accumulate(begin, end, 0.0) / nb_chains;
+            double sum_of_squares = 0;
+            for (const double* frequency = begin; frequency != end; frequency++) {
+                sum_of_squares += (*frequency - mean) * (*frequency - mean);
+            }
+            total += std::sqrt(sum_of_squares / (nb_chains - 1));
+            nb_splits++;
+        }
+    }
+    return nb_splits != 0 ? total / nb_splits : 0.0;
+}
+
+/*================================================================================================*/
+// Consensus trees. Splits are stored as the side without leaf 0, so two of them are compatible
+// (can be in the same tree) when their sides are nested or disjoint, and a set of compatible splits
+// is built into a tree by adding sides from the largest to the smallest.
+namespace {
+bool compatible(const std::uint64_t* a, const std::uint64_t* b, std::size_t nb_words) {
+    bool a_in_b = true, b_in_a = true, disjoint = true;
+    for (std::size_t i = 0; i < nb_words; i++) {
+        a_in_b = a_in_b and (a[i] & ~b[i]) == 0;
+        b_in_a = b_in_a and (b[i] & ~a[i]) == 0;
+        disjoint = disjoint and (a[i] & b[i]) == 0;
+    }
+    return a_in_b or b_in_a or disjoint;
+}
+
+std::size_t popcount(const std::uint64_t* split, std::size_t nb_words) {
+    std::size_t result = 0;
+    for (std::size_t i = 0; i < nb_words; i++) {
+        result += __builtin_popcountll(split[i]);
+    }
+    return result;
+}
+}  // namespace
+
+DoubleListAnnotatedTree consensus_tree(const SplitFrequencies& frequencies,
+                                       const ConsensusOptions& options) {
+    const SplitDictionary& splits = frequencies.splits();
+    std::size_t nb_words = splits.nb_words(), nb_leaves = splits.nb_leaves();
+
+    // majority splits are always compatible with each other; the greedy consensus then tries the
+    // others in decreasing order of frequency
+    std::vector<int> candidates(splits.size());
+    std::iota(candidates.begin(), candidates.end(), 0);
+    std::stable_sort(candidates.begin(), candidates.end(), [&](int a, int b) {
+        return frequencies.count(a) > frequencies.count(b);
+    });
+    std::vector<int> chosen;
+    for (auto split : candidates) {
+        if (2 * frequencies.count(split) > frequencies.nb_trees()) {
+            chosen.push_back(split);
+        } else if (options.greedy and chosen.size() + 3 < nb_leaves and
+                   std::all_of(chosen.begin(), chosen.end(), [&](int other) {
+                       return compatible(splits.split(split), splits.split(other), nb_words);
+                   })) {
+            chosen.push_back(split);
+        }
+    }
+
+    // Each split becomes a child of the smallest larger split containing it, found through the
+    // deepest node created so far above its first leaf. Then its leaves, found a word at a time,
+    // get it as their deepest node: O(nb_words + size of the split) for each split.
+    std::vector<std::size_t> sizes(splits.size());
+    for (auto split : chosen) {
+        sizes[split] = popcount(splits.split(split), nb_words);
+    }
+    std::stable_sort(chosen.begin(), chosen.end(),
+                     [&](int a, int b) { return sizes[a] > sizes[b]; });
+    DoubleListAnnotatedTree tree;
+    if (nb_leaves == 0) {  // no trees counted: an empty tree
+        tree.finalize();
+        return tree;
+    }
+    tree.reserve(nb_leaves + chosen.size() + 1);
+    int root = tree.add_node(-1);
+    std::vector<int> deepest(nb_leaves, root);
+    std::ostringstream support;
+    for (auto split : chosen) {
+        const std::uint64_t* side = splits.split(split);
+        int node = -1;
+        for (std::size_t word = 0; word < nb_words; word++) {
+            for (std::uint64_t bits = side[word]; bits != 0; bits &= bits - 1) {
+                std::size_t leaf = word * 64 + __builtin_ctzll(bits);
+                if (node == -1) {
+                    node = tree.add_node(deepest[leaf]);
+                }
+                deepest[leaf] = node;
+            }
+        }
+        support.str("");
+        support << frequencies.frequency(split);
+        tree.set_tag(node, options.support_tag, support.str());
+    }
+    for (std::size_t leaf = 0; leaf < nb_leaves; leaf++) {
+        tree.set_tag(tree.add_node(deepest[leaf]), "name", splits.leaf_name(leaf));
     }
-    next_token = Token{Invalid, it == scit(input.end())
-                                    ? "end of input"
-                                    : ("token starting with " + std::string(it, it + 1))};
-}
\ No newline at end of file
+    tree.finalize();
+    return tree;
+}
@@ -25,173 +25,888 @@ more generally, to use and operate it in the same conditions as regards security
 The fact that you are presently reading this means that you have had knowledge of the CeCILL-C
 license and that you accept its terms.*/
 
+#include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <iterator>
 #include <map>
 #include <sstream>
+#include <stdexcept>
 #include <string>
 #include <unordered_map>
 #include <vector>
-#include <algorithm> // for std::sort
+#include <algorithm> // for std::max
 
 /*
 ====================================================================================================
   ~*~ Pure interfaces ~*~
 ==================================================================================================*/
+// Non-owning view of a string (C++11 has no std::string_view)
+class StringView {
+    const char* data_{nullptr};
+    std::size_t size_{0};
+
+  public:
+    StringView() = default;
+    StringView(const char* data, std::size_t size) : data_(data), size_(size) {}
+    StringView(const char* s) : data_(s), size_(std::strlen(s)) {}
+    StringView(const std::string& s) : data_(s.data()), size_(s.size()) {}
+
+    const char* data() const { return data_; }
+    std::size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    std::string str() const { return std::string(data_, size_); }
+    operator std::string() const { return str(); }
+};
+
+inline bool operator==(StringView a, StringView b) {
+    return a.size() == b.size() and (a.empty() or std::memcmp(a.data(), b.data(), a.size()) == 0);
+}
+
+inline bool operator!=(StringView a, StringView b) { return not(a == b); }
+
+inline std::ostream& operator<<(std::ostream& os, StringView s) {
+    return os.write(s.data(), s.size());
+}
+
+/*================================================================================================*/
+// Monotonic memory arena: allocations are carved out of a few large blocks, deallocation does
+// nothing, and all memory is released at once by reset (which keeps the blocks for reuse) or by the
+// destructor. Not thread-safe.
+class Arena {
+    struct Block {
+        char* data;
+        std::size_t size;
+    };
+    std::vector<Block> blocks;
+    std::size_t current{0};  // index in blocks of the block allocations are taken from
+    std::size_t used{0};     // bytes used in the current block
+    std::size_t block_size;
+
+  public:
+    explicit Arena(std::size_t block_size = 1 << 16) : block_size(block_size) {}
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    ~Arena() {
+        for (auto& block : blocks) {
+            ::operator delete(block.data);
+        }
+    }
+
+    void* allocate(std::size_t size, std::size_t alignment) {
+        while (current < blocks.size()) {
+            std::uintptr_t address = reinterpret_cast<std::uintptr_t>(blocks[current].data) + used;
+            std::size_t padding = (alignment - address % alignment) % alignment;
+            if (used + padding + size <= blocks[current].size) {
+                used += padding + size;
+                return blocks[current].data + used - size;
+            }
+            current++;
+            used = 0;
+        }
+        // blocks come from operator new, so they are suitably aligned for any type
+        std::size_t size_to_allocate = std::max(size, block_size);
+        char* data = static_cast<char*>(::operator new(size_to_allocate));
+        blocks.push_back(Block{data, size_to_allocate});
+        block_size *= 2;  // few blocks even when the arena grows large
+        used = size;
+        return data;
+    }
+
+    // releases all allocations, keeping the blocks for reuse
+    void reset() {
+        current = 0;
+        used = 0;
+    }
+
+    // total size of the blocks
+    std::size_t capacity() const {
+        std::size_t result = 0;
+        for (auto& block : blocks) {
+            result += block.size;
+        }
+        return result;
+    }
+};
+
+// Standard allocator taking its memory from an Arena, or from the heap if arena is null.
+// Containers keep their arena when they are copied, moved, or assigned.
+template <class T>
+class ArenaAllocator {
+  public:
+    using value_type = T;
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    Arena* arena{nullptr};
+
+    ArenaAllocator() = default;
+    explicit ArenaAllocator(Arena* arena) : arena(arena) {}
+    template <class U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+    T* allocate(std::size_t n) {
+        return arena != nullptr ? static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T)))
+                                : std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T* p, std::size_t n) {
+        if (arena == nullptr) {
+            std::allocator<T>().deallocate(p, n);
+        }
+    }
+};
+
+template <class T, class U>
+bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+    return a.arena == b.arena;
+}
+
+template <class T, class U>
+bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+    return a.arena != b.arena;
+}
+
+template <class T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+using ArenaString = std::basic_string<char, std::char_traits<char>, ArenaAllocator<char>>;
+
+/*================================================================================================*/
+// Non-owning view of a contiguous list of node indices, e.g., the children of a node
+class NodeRange {
+    const int* begin_{nullptr};
+    const int* end_{nullptr};
+
+  public:
+    NodeRange() = default;
+    NodeRange(const int* begin, const int* end) : begin_(begin), end_(end) {}
+    NodeRange(const std::vector<int>& nodes) : begin_(nodes.data()), end_(begin_ + nodes.size()) {}
+
+    const int* begin() const { return begin_; }
+    const int* end() const { return end_; }
+    std::size_t size() const { return end_ - begin_; }
+    bool empty() const { return begin_ == end_; }
+    int operator[](std::size_t i) const { return begin_[i]; }
+};
+
+inline bool operator==(NodeRange a, NodeRange b) {
+    return a.size() == b.size() and std::equal(a.begin(), a.end(), b.begin());
+}
+
+inline bool operator!=(NodeRange a, NodeRange b) { return not(a == b); }
+
+// Consecutive node indices begin, begin + 1, ..., end - 1
+class IndexRange {
+    int begin_{0};
+    int end_{0};
+
+  public:
+    class iterator {
+        int i;
+
+      public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = int;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const int*;
+        using reference = int;
+
+        explicit iterator(int i) : i(i) {}
+        int operator*() const { return i; }
+        iterator& operator++() {
+            i++;
+            return *this;
+        }
+        bool operator==(iterator other) const { return i == other.i; }
+        bool operator!=(iterator other) const { return i != other.i; }
+    };
+
+    IndexRange() = default;
+    IndexRange(int begin, int end) : begin_(begin), end_(end) {}
+
+    iterator begin() const { return iterator(begin_); }
+    iterator end() const { return iterator(end_); }
+    std::size_t size() const { return end_ - begin_; }
+    bool empty() const { return begin_ == end_; }
+    bool contains(int i) const { return i >= begin_ and i < end_; }
+};
+
+/*================================================================================================*/
+class LeafNames;
+
 class AnnotatedTree {
   public:
     using NodeIndex = int;
     using TagName = std::string;
     using TagValue = std::string;
-    using ChildrenList = std::vector<NodeIndex>;
+    using TagId = int;
+    using ChildrenList = NodeRange;
 
-    virtual const ChildrenList& children(NodeIndex) const = 0;
+    virtual ChildrenList children(NodeIndex) const = 0;
     virtual NodeIndex parent(NodeIndex) const = 0;
     virtual NodeIndex root() const = 0;
     virtual std::size_t nb_nodes() const = 0;
-    virtual TagValue tag(NodeIndex, TagName) const = 0;
+    virtual TagValue tag(NodeIndex, const TagName&) const = 0;
+
+    // Integer key of a tag name in this tree (-1 if the tag name was never registered), valid until
+    // the tree is modified. tag(node, tag_id(name)) is tag(node, name) without the name lookup; the
+    // view it returns is valid until the tree is modified.
+    virtual TagId tag_id(const TagName&) const = 0;
+    virtual StringView tag(NodeIndex, TagId) const = 0;
 
     virtual std::string as_string() const = 0;
-    virtual std::vector<std::string> descendant_leaves(NodeIndex) const = 0;
     virtual bool operator==(const AnnotatedTree& other) const = 0;
 
+    // leaves of the subtree of a node, in depth-first order
+    virtual NodeRange leaves(NodeIndex) const = 0;
+
+    // names of the leaves of the subtree of a node (see LeafNames)
+    LeafNames descendant_leaves(NodeIndex) const;
+
+    // number of nodes in the subtree of a node (including the node)
+    virtual std::size_t subtree_size(NodeIndex) const = 0;
+
+    // True if nodes are numbered in preorder (parents before children, and each subtree numbered
+    // consecutively), which parsers guarantee. The subtree of node is then the range of indices
+    // subtree_range(node) = [node, node + subtree_size(node)).
+    virtual bool is_preorder() const = 0;
+    virtual IndexRange subtree_range(NodeIndex) const = 0;
+
     virtual ~AnnotatedTree() = default;
 };
 
+// Names of a list of leaves, in the same order, looked up when accessed. Valid until the tree is
+// modified.
+class LeafNames {
+    const AnnotatedTree* tree;
+    NodeRange leaves;
+    AnnotatedTree::TagId name;
+
+  public:
+    class iterator {
+        const LeafNames* names;
+        const int* leaf;
+
+      public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = StringView;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const StringView*;
+        using reference = StringView;
+
+        iterator(const LeafNames* names, const int* leaf) : names(names), leaf(leaf) {}
+        StringView operator*() const { return names->tree->tag(*leaf, names->name); }
+        iterator& operator++() {
+            leaf++;
+            return *this;
+        }
+        bool operator==(iterator other) const { return leaf == other.leaf; }
+        bool operator!=(iterator other) const { return leaf != other.leaf; }
+    };
+
+    LeafNames(const AnnotatedTree& tree, NodeRange leaves)
+        : tree(&tree), leaves(leaves), name(tree.tag_id("name")) {}
+
+    iterator begin() const { return iterator(this, leaves.begin()); }
+    iterator end() const { return iterator(this, leaves.end()); }
+    std::size_t size() const { return leaves.size(); }
+    bool empty() const { return leaves.empty(); }
+    StringView operator[](std::size_t i) const { return tree->tag(leaves[i], name); }
+
+    operator std::vector<std::string>() const { return std::vector<std::string>(begin(), end()); }
+};
+
+inline bool operator==(const LeafNames& a, const std::vector<std::string>& b) {
+    return a.size() == b.size() and std::equal(a.begin(), a.end(), b.begin());
+}
+
+inline LeafNames AnnotatedTree::descendant_leaves(NodeIndex node) const {
+    return LeafNames(*this, leaves(node));
+}
+
 class TreeParser {
   public:
     virtual const AnnotatedTree& get_tree() const = 0;
     virtual ~TreeParser() = default;
 };
 
+/*================================================================================================*/
+// Options of DoubleListAnnotatedTree::append_nhx and write_nhx. Only with both sorted_tags and
+// sorted_children are trees a and b with a == b and b == a written to identical bytes (up to
+// collisions of subtree_hashes); a == b alone is not enough, as operator== only compares the tags
+// of its left-hand tree. Tag values are compared as text, so the same length written differently
+// (1 and 1.0) still gives different trees and bytes, unless length_digits makes them alike; set it
+// too before hashing or deduplicating the text.
+struct NHXWriterOptions {
+    // NHX tags in lexicographic order of keys instead of order of first use, leaving out tags with
+    // empty values (which operator== takes as absent)
+    bool sorted_tags{false};
+
+    // children in increasing order of subtree hash instead of index order
+    bool sorted_children{false};
+
+    // if not empty, only these tags are written (name and length included)
+    std::vector<std::string> include_tags;
+
+    // tags not written (name and length included)
+    std::vector<std::string> exclude_tags;
+
+    // false to leave out "[&&NHX...]" comments: plain Newick with names and lengths
+    bool nhx_tags{true};
+
+    // false to leave out the names of internal nodes
+    bool internal_names{true};
+
+    // -1 to copy lengths as they are; 0 to write each length as the shortest text that reads back
+    // as the same double, n > 0 to round it to n significant digits (lengths that are not numbers
+    // are copied)
+    int length_digits{-1};
+
+    // With the other options left to their defaults, the subtrees of trees parsed with
+    // NHXParserOptions::record_spans that were not modified since are copied from the input, as
+    // they were written there (spacing, comments and order of tags included).
+    bool copy_source{true};
+};
+
 /*
 ====================================================================================================
   ~*~ Implementations ~*~
 ==================================================================================================*/
 class DoubleListAnnotatedTree : public AnnotatedTree {
   public:
-    using Node = std::unordered_map<std::string, std::string>;
+    // a range of characters in text_
+    struct TextRange {
+        std::size_t offset;
+        std::size_t size;
+    };
+
+    // all the values of one tag key, indexed by node
+    struct TagColumn {
+        TextRange key;
+        ArenaVector<TextRange> values;       // element i is the value of node i, if present
+        ArenaVector<std::uint64_t> present;  // bit i is set if node i has this tag
+
+        // dictionary encoding: each distinct value is stored once in dictionary, and element i of
+        // codes (used instead of values) is the index in dictionary of the value of node i
+        bool encoded{false};
+        ArenaVector<std::uint32_t> codes;
+        ArenaVector<TextRange> dictionary;
+        ArenaVector<std::uint32_t> slots;  // hash table of dictionary (code + 1, 0 if empty)
+
+        explicit TagColumn(Arena* arena)
+            : key{0, 0},
+              values(ArenaAllocator<TextRange>(arena)),
+              present(ArenaAllocator<std::uint64_t>(arena)),
+              codes(ArenaAllocator<std::uint32_t>(arena)),
+              dictionary(ArenaAllocator<TextRange>(arena)),
+              slots(ArenaAllocator<std::uint32_t>(arena)) {}
+
+        bool has(NodeIndex node) const {
+            std::size_t word = node / 64;
+            return word < present.size() and ((present[word] >> (node % 64)) & 1) != 0;
+        }
+
+        // value of node, which must have this tag
+        const TextRange& value(NodeIndex node) const {
+            return encoded ? dictionary[codes[node]] : values[node];
+        }
+
+        // removes all values, keeping allocated storage for reuse
+        void clear() {
+            values.clear();
+            present.clear();
+            encoded = false;
+            codes.clear();
+            dictionary.clear();
+            slots.clear();
+        }
+    };
+
+    // where all the containers below take their memory from (the heap if null)
+    Arena* arena_;
+
+    // all tag keys and values, stored back to back
+    ArenaString text_;
 
-    std::vector<Node> nodes_;
+    // one column per tag key, in order of first use; only the first nb_columns_ are in use (the
+    // others are kept to reuse their storage after clear)
+    ArenaVector<TagColumn> columns_;
+    std::size_t nb_columns_{0};
 
-    // invariant: same length as nodes
     // invariant: only one node has parent -1
     // element i is the index of parent of i in nodes (-1 for root)
-    std::vector<int> parent_;
+    ArenaVector<int> parent_;
 
-    // invariant: consistent with parent
-    // element i is a vector of indices corresponding to the children of node i
-    std::vector<std::vector<int>> children_;
+    // invariant: consistent with parent once finalized
+    // children of node i are child_list_[j] for child_offsets_[i] <= j < child_offsets_[i + 1], in
+    // increasing index order (compressed sparse row layout)
+    ArenaVector<int> child_offsets_;
+    ArenaVector<int> child_list_;
+    bool finalized_{false};
+
+    // computed by finalize: element i is the number of nodes in the subtree of node i
+    ArenaVector<int> subtree_size_;
+    bool preorder_{false};
+
+    // computed by finalize: leaves in depth-first order; the leaves of the subtree of node i are
+    // leaves_[j] for first_leaf_[i] <= j < leaf_end_[i]
+    ArenaVector<int> leaves_;
+    ArenaVector<int> first_leaf_;
+    ArenaVector<int> leaf_end_;
 
     // invariant: node with index root is only node with parent -1
-    NodeIndex root_;
+    NodeIndex root_{0};
 
-  public:
-    const ChildrenList& children(NodeIndex node) const final { return children_.at(node); }
+    // Text the tree was parsed from, if recorded (see NHXParserOptions::record_spans): element i
+    // of spans_ is the range in source_ of the subtree of node i, unless bit i of modified_ is set
+    // because the node or one of its descendants was added or had a tag set since.
+    const char* source_{nullptr};
+    ArenaVector<TextRange> spans_;
+    ArenaVector<std::uint64_t> modified_;
 
-    NodeIndex parent(NodeIndex node) const final { return parent_.at(node); }
+    // number of nodes storage is reserved for, also used to size new columns
+    std::size_t reserved_nodes_{0};
 
-    NodeIndex root() const final { return root_; }
+    TextRange append_text(const char* data, std::size_t size) {
+        TextRange result{text_.size(), size};
+        text_.append(data, size);
+        return result;
+    }
 
-    std::size_t nb_nodes() const final { return nodes_.size(); }
+    bool text_equals(TextRange range, const char* data, std::size_t size) const {
+        return range.size == size and std::memcmp(text_.data() + range.offset, data, size) == 0;
+    }
+
+    std::string text(TextRange range) const {
+        return std::string(text_.data() + range.offset, range.size);
+    }
+
+    // returns the index in columns_ of the column with given key (-1 if there is none)
+    int find_column(const char* key, std::size_t key_size) const {
+        for (std::size_t column = 0; column < nb_columns_; column++) {
+            if (text_equals(columns_[column].key, key, key_size)) {
+                return column;
+            }
+        }
+        return -1;
+    }
 
-    TagValue tag(NodeIndex node, TagName tag) const final {
-        if (nodes_.at(node).count(tag) != 0) {
-            return nodes_.at(node).at(tag);
+    int add_column(const char* key, std::size_t key_size, bool encoded = false) {
+        if (nb_columns_ == columns_.size()) {
+            columns_.emplace_back(arena_);
+        }
+        TagColumn& column = columns_[nb_columns_];
+        column.key = append_text(key, key_size);
+        column.encoded = encoded;
+        if (encoded) {
+            column.codes.reserve(reserved_nodes_);
         } else {
-            return "";
+            column.values.reserve(reserved_nodes_);
         }
+        column.present.reserve((reserved_nodes_ + 63) / 64);
+        return nb_columns_++;
     }
 
-    std::string recursive_string(NodeIndex node) const {
-        std::string newick;
+    const TagColumn& column(TagId tag) const {
+        if (tag < 0 or tag >= int(nb_columns_)) {
+            throw std::out_of_range("no tag id " + std::to_string(tag));
+        }
+        return columns_[tag];
+    }
 
-        if (not children(node).empty()) {
-            // It's an internal node
-            newick += "(";
-            for (auto const child : children(node)) {
-                newick += recursive_string(child) + ",";
-            };
-            newick.pop_back();
-            newick += ")";
+    // value of tag in column for node (nullptr if the node does not have this tag)
+    const TextRange* find_value(int column, NodeIndex node) const {
+        if (static_cast<std::size_t>(node) >= parent_.size()) {
+            throw std::out_of_range("no node " + std::to_string(node));
+        } else if (column < -1 or column >= int(nb_columns_)) {
+            throw std::out_of_range("no tag id " + std::to_string(column));
         }
-        auto node_annotation = nodes_.at(node);
-        if (node_annotation.count("name") != 0) {
-            newick += nodes_.at(node).at("name");
-            node_annotation.erase("name");
+        return column != -1 and columns_[column].has(node) ? &columns_[column].value(node)
+                                                           : nullptr;
+    }
+
+    // FNV-1a
+    static std::uint64_t hash_text(const char* data, std::size_t size) {
+        std::uint64_t hash = 14695981039346656037ull;
+        for (std::size_t i = 0; i < size; i++) {
+            hash = (hash ^ static_cast<unsigned char>(data[i])) * 1099511628211ull;
         }
-        if (node_annotation.count("length") != 0) {
-            newick += ":" + nodes_.at(node).at("length");
-            node_annotation.erase("length");
+        return hash;
+    }
+
+    // returns the code of value in the dictionary of column, adding it if needed (stored is where
+    // value already is in text_, if it is)
+    std::uint32_t intern(TagColumn& column, const char* value, std::size_t value_size,
+                         const TextRange* stored = nullptr) {
+        if ((column.dictionary.size() + 1) * 2 > column.slots.size()) {  // grow the hash table
+            std::size_t nb_slots = std::max(std::size_t(16), column.slots.size() * 2);
+            while ((column.dictionary.size() + 1) * 2 > nb_slots) {  // if slots were left empty
+                nb_slots *= 2;
+            }
+            column.slots.assign(nb_slots, 0);
+            for (std::size_t code = 0; code < column.dictionary.size(); code++) {
+                const TextRange& range = column.dictionary[code];
+                std::size_t slot = hash_text(text_.data() + range.offset, range.size);
+                while (column.slots[slot &= column.slots.size() - 1] != 0) {
+                    slot++;
+                }
+                column.slots[slot] = code + 1;
+            }
         }
-        if (not node_annotation.empty()) {
-            newick += "[&&NHX";
-            for (auto& it : node_annotation) {
-                newick += ":" + it.first + "=" + it.second;
+        std::size_t slot = hash_text(value, value_size);
+        while (column.slots[slot &= column.slots.size() - 1] != 0) {
+            std::uint32_t code = column.slots[slot] - 1;
+            if (text_equals(column.dictionary[code], value, value_size)) {
+                return code;
             }
-            newick += "]";
+            slot++;
         }
-        return newick;
+        column.dictionary.push_back(stored != nullptr ? *stored : append_text(value, value_size));
+        column.slots[slot] = column.dictionary.size();
+        return column.dictionary.size() - 1;
     }
 
-    std::string as_string() const final { return recursive_string(root()) + "; "; }
+  public:
+    // If arena is not null, all the memory of the tree comes from it (it must outlive the tree, and
+    // trees copied or moved from this one).
+    explicit DoubleListAnnotatedTree(Arena* arena = nullptr)
+        : arena_(arena),
+          text_(ArenaAllocator<char>(arena)),
+          columns_(ArenaAllocator<TagColumn>(arena)),
+          parent_(ArenaAllocator<int>(arena)),
+          child_offsets_(ArenaAllocator<int>(arena)),
+          child_list_(ArenaAllocator<int>(arena)),
+          subtree_size_(ArenaAllocator<int>(arena)),
+          leaves_(ArenaAllocator<int>(arena)),
+          first_leaf_(ArenaAllocator<int>(arena)),
+          leaf_end_(ArenaAllocator<int>(arena)),
+          spans_(ArenaAllocator<TextRange>(arena)),
+          modified_(ArenaAllocator<std::uint64_t>(arena)) {}
+
+    // Adds a node as the last child of parent (-1 for the root, which must be the first node) and
+    // returns its index. The tree must then be finalized before children are accessed.
+    NodeIndex add_node(NodeIndex parent) {
+        NodeIndex node = parent_.size();
+        if (parent < -1 or parent >= node) {
+            throw std::out_of_range("no node " + std::to_string(parent));
+        } else if (parent == -1 and node != 0) {
+            throw std::logic_error("tree already has a root");
+        }
+        parent_.push_back(parent);
+        if (parent == -1) {
+            root_ = node;
+        }
+        finalized_ = false;
+        if (source_ != nullptr) {
+            mark_modified(node);
+        }
+        return node;
+    }
 
-    std::vector<std::string> descendant_leaves(NodeIndex node) const final {
-        std::vector<std::string> leaves(0);
-        if (children(node).empty()) {
-            leaves.emplace_back(tag(node, "name"));
-        } else {
-            for (auto const& child : children(node)) {
-                auto v2 = descendant_leaves(child);
-                if (not v2.empty()) {
-                    leaves.insert(leaves.end(), v2.begin(), v2.end());
+    // Sets source_ to the text the tree was parsed from, once spans_ holds the span of each node in
+    // it (all nodes are then unmodified); the text must outlive the tree and its copies.
+    void set_source(const char* source) {
+        source_ = source;
+        modified_.assign((spans_.size() + 63) / 64, 0);
+    }
+
+    // marks node and its ancestors as modified since parsing
+    void mark_modified(NodeIndex node) {
+        if (modified_.size() <= static_cast<std::size_t>(node / 64)) {
+            modified_.resize(node / 64 + 1, 0);
+        }
+        while (node != -1 and not is_modified(node)) {
+            modified_[node / 64] |= std::uint64_t(1) << (node % 64);
+            node = parent_[node];
+        }
+    }
+
+    // true if the subtree of node is not the text of its span in source_
+    bool is_modified(NodeIndex node) const {
+        std::size_t word = node / 64;
+        return source_ == nullptr or word >= modified_.size() or
+               ((modified_[word] >> (node % 64)) & 1) != 0;
+    }
+
+    // builds the children lists, subtree sizes and leaf lists from parents
+    void finalize() {
+        std::size_t nb_nodes = parent_.size();
+        // count children in child_offsets_[parent + 1], then use child_offsets_[parent] as the
+        // insertion cursor of the children of parent, which shifts the offsets by one
+        child_offsets_.assign(nb_nodes + 1, 0);
+        for (int parent : parent_) {
+            child_offsets_[parent + 1]++;
+        }
+        child_list_.resize(nb_nodes - child_offsets_[0]);
+        child_offsets_[0] = 0;
+        for (std::size_t node = 1; node <= nb_nodes; node++) {
+            child_offsets_[node] += child_offsets_[node - 1];
+        }
+        for (std::size_t node = 0; node < nb_nodes; node++) {
+            if (parent_[node] != -1) {
+                child_list_[child_offsets_[parent_[node]]++] = node;
+            }
+        }
+        for (std::size_t node = nb_nodes; node > 0; node--) {
+            child_offsets_[node] = child_offsets_[node - 1];
+        }
+        child_offsets_[0] = 0;
+
+        // parents have smaller indices than their children (see add_node)
+        subtree_size_.assign(nb_nodes, 1);
+        for (std::size_t node = nb_nodes; node-- > 0;) {
+            if (parent_[node] != -1) {
+                subtree_size_[parent_[node]] += subtree_size_[node];
+            }
+        }
+        // preorder: the first child of a node comes right after it, the next children right after
+        // the subtree of the previous one
+        preorder_ = root_ == 0 and (nb_nodes == 0 or subtree_size_[0] == int(nb_nodes));
+        for (std::size_t node = 0; node < nb_nodes and preorder_; node++) {
+            int next = node + 1;
+            for (int i = child_offsets_[node]; i < child_offsets_[node + 1]; i++) {
+                preorder_ = preorder_ and child_list_[i] == next;
+                next += subtree_size_[child_list_[i]];
+            }
+        }
+
+        // depth-first order: node at position k is order[k] (or k if nodes are in preorder)
+        std::vector<int> order;
+        if (not preorder_ and nb_nodes != 0) {
+            std::vector<int> stack{root_};
+            while (not stack.empty()) {
+                int node = stack.back();
+                stack.pop_back();
+                order.push_back(node);
+                for (int i = child_offsets_[node + 1]; i-- > child_offsets_[node];) {
+                    stack.push_back(child_list_[i]);
                 }
             }
         }
-        return leaves;
+        auto node_at = [&](std::size_t k) { return preorder_ ? int(k) : order[k]; };
+        // subtrees are consecutive in depth-first order, and so are their leaves
+        leaves_.clear();
+        first_leaf_.resize(nb_nodes);
+        leaf_end_.resize(nb_nodes);
+        for (std::size_t k = 0; k < nb_nodes; k++) {
+            int node = node_at(k);
+            first_leaf_[node] = leaves_.size();
+            if (child_offsets_[node] == child_offsets_[node + 1]) {
+                leaves_.push_back(node);
+            }
+        }
+        for (std::size_t k = 0; k < nb_nodes; k++) {
+            int node = node_at(k);
+            std::size_t subtree_end = k + subtree_size_[node];
+            leaf_end_[node] = subtree_end < nb_nodes ? first_leaf_[node_at(subtree_end)]
+                                                     : int(leaves_.size());
+        }
+        finalized_ = true;
     }
 
-    int recursive_diff(NodeIndex node, const AnnotatedTree& other, NodeIndex other_node) const {
-        int diff = 0;
-
-        if (children(node).size() != other.children(other_node).size()) {
-            diff++;
+    // sets (or replaces) a tag of a node; does not allocate except to grow the shared buffers
+    void set_tag(NodeIndex node, const char* key, std::size_t key_size, const char* value,
+                 std::size_t value_size) {
+        if (static_cast<std::size_t>(node) >= parent_.size()) {
+            throw std::out_of_range("no node " + std::to_string(node));
+        }
+        int column_index = find_column(key, key_size);
+        TagColumn& column = columns_[column_index != -1 ? column_index : add_column(key, key_size)];
+        if (column.present.size() <= static_cast<std::size_t>(node / 64)) {
+            column.present.resize(node / 64 + 1, 0);
+        }
+        if (column.encoded) {
+            if (column.codes.size() <= static_cast<std::size_t>(node)) {
+                column.codes.resize(node + 1);
+            }
+            column.codes[node] = intern(column, value, value_size);
         } else {
-            for (auto const& child : children(node)) {
-                auto child_leaves = descendant_leaves(child);
-                std::sort(child_leaves.begin(), child_leaves.end());
-                bool no_counterpart = true;
-                for (auto const& other_child : other.children(other_node)) {
-                    auto other_leaves = other.descendant_leaves(other_child);
-                    std::sort(other_leaves.begin(), other_leaves.end());
-
-                    if (tag(child, "name") == other.tag(other_child, "name") and
-                        tag(child, "length") == other.tag(other_child, "length") and
-                        child_leaves == other_leaves) {
-                        no_counterpart = false;
-                        diff += recursive_diff(child, other, other_child);
-                    }
-                }
-                if (no_counterpart) {
-                    diff++;
+            if (column.values.size() <= static_cast<std::size_t>(node)) {
+                column.values.resize(node + 1);
+            }
+            column.values[node] = append_text(value, value_size);
+        }
+        column.present[node / 64] |= std::uint64_t(1) << (node % 64);
+        if (source_ != nullptr) {
+            mark_modified(node);
+        }
+    }
+
+    void set_tag(NodeIndex node, const TagName& tag, const TagValue& value) {
+        set_tag(node, tag.data(), tag.size(), value.data(), value.size());
+    }
+
+    // Dictionary-encodes the values of tag (now and when set later): each distinct value is stored
+    // once, and nodes hold 32-bit codes instead (see tag_code). Meant for tags with few distinct
+    // values, such as event types or species. Returns the id of tag (a column is created if no
+    // node has it yet).
+    TagId dictionary_encode(const TagName& tag) {
+        int id = find_column(tag.data(), tag.size());
+        if (id == -1) {
+            return add_column(tag.data(), tag.size(), true);
+        }
+        TagColumn& column = columns_[id];
+        if (not column.encoded) {
+            column.codes.resize(column.values.size());
+            for (std::size_t node = 0; node < column.values.size(); node++) {
+                if (column.has(node)) {
+                    const TextRange& range = column.values[node];
+                    column.codes[node] =
+                        intern(column, text_.data() + range.offset, range.size, &range);
                 }
             }
+            column.values.clear();
+            column.encoded = true;
         }
+        return id;
+    }
+
+    // Code of the value of a dictionary-encoded tag for node (-1 if node does not have this tag).
+    // Two nodes have the same value for the tag if and only if they have the same code.
+    int tag_code(NodeIndex node, TagId tag) const {
+        const TextRange* value = find_value(tag, node);
+        if (tag != -1 and not columns_[tag].encoded) {
+            throw std::invalid_argument("tag " + text(columns_[tag].key) +
+                                        " is not dictionary-encoded");
+        }
+        return value != nullptr ? int(columns_[tag].codes[node]) : -1;
+    }
+
+    // value with given code in the dictionary of tag
+    StringView decode(TagId tag, int code) const {
+        const TextRange& range = column(tag).dictionary.at(code);
+        return StringView(text_.data() + range.offset, range.size);
+    }
 
-        for (auto& it : nodes_.at(node)) {
-            if (it.second != other.tag(other_node, it.first)) {
-                diff++;
-            };
+    // number of distinct values of a dictionary-encoded tag
+    std::size_t dictionary_size(TagId tag) const { return column(tag).dictionary.size(); }
+
+    // reserves storage for nb_nodes nodes
+    void reserve(std::size_t nb_nodes) {
+        reserved_nodes_ = nb_nodes;
+        parent_.reserve(nb_nodes);
+        child_offsets_.reserve(nb_nodes + 1);
+        child_list_.reserve(nb_nodes);
+        subtree_size_.reserve(nb_nodes);
+        leaves_.reserve(nb_nodes);
+        first_leaf_.reserve(nb_nodes);
+        leaf_end_.reserve(nb_nodes);
+    }
+
+    // removes all nodes, keeping allocated storage for reuse
+    void clear() {
+        text_.clear();
+        for (auto& column : columns_) {
+            column.clear();
         }
+        nb_columns_ = 0;
+        parent_.clear();
+        child_offsets_.clear();
+        child_list_.clear();
+        subtree_size_.clear();
+        leaves_.clear();
+        first_leaf_.clear();
+        leaf_end_.clear();
+        finalized_ = false;
+        root_ = 0;
+        source_ = nullptr;
+        spans_.clear();
+        modified_.clear();
+    }
 
-        return diff;
+    // throws if the tree is not finalized or node does not exist
+    void check_finalized(NodeIndex node) const {
+        if (not finalized_) {
+            throw std::logic_error("tree is not finalized");
+        } else if (static_cast<std::size_t>(node) >= parent_.size()) {
+            throw std::out_of_range("no node " + std::to_string(node));
+        }
     }
 
-    bool operator==(const AnnotatedTree& other) const final {
-        if (nb_nodes() != other.nb_nodes()) {
-            return false;
-        };
-        return recursive_diff(root(), other, other.root()) == 0;
+    ChildrenList children(NodeIndex node) const final {
+        check_finalized(node);
+        const int* list = child_list_.data();
+        return ChildrenList(list + child_offsets_[node], list + child_offsets_[node + 1]);
     }
+
+    std::size_t subtree_size(NodeIndex node) const final {
+        check_finalized(node);
+        return subtree_size_[node];
+    }
+
+    bool is_preorder() const final {
+        if (not finalized_) {
+            throw std::logic_error("tree is not finalized");
+        }
+        return preorder_;
+    }
+
+    IndexRange subtree_range(NodeIndex node) const final {
+        check_finalized(node);
+        if (not preorder_) {
+            throw std::logic_error("tree is not numbered in preorder");
+        }
+        return IndexRange(node, node + subtree_size_[node]);
+    }
+
+    NodeRange leaves(NodeIndex node) const final {
+        check_finalized(node);
+        return NodeRange(leaves_.data() + first_leaf_[node], leaves_.data() + leaf_end_[node]);
+    }
+
+    NodeIndex parent(NodeIndex node) const final { return parent_.at(node); }
+
+    NodeIndex root() const final { return root_; }
+
+    std::size_t nb_nodes() const final { return parent_.size(); }
+
+    TagValue tag(NodeIndex node, const TagName& tag) const final {
+        const TextRange* value = find_value(find_column(tag.data(), tag.size()), node);
+        return value != nullptr ? text(*value) : "";
+    }
+
+    TagId tag_id(const TagName& tag) const final { return find_column(tag.data(), tag.size()); }
+
+    StringView tag(NodeIndex node, TagId tag) const final {
+        const TextRange* value = find_value(tag, node);
+        return value != nullptr ? StringView(text_.data() + value->offset, value->size)
+                                : StringView();
+    }
+
+    // Writes the tree in NHX format, followed by ';': children, then name, ":" length and the
+    // other tags as "[&&NHX:key=value...]", by default in index and column order. Nodes are
+    // visited without recursion and their text is copied straight from text_.
+    void append_nhx(std::string& out, const NHXWriterOptions& options = {}) const;
+    void write_nhx(std::ostream& out, const NHXWriterOptions& options = {}) const;
+    // throws std::runtime_error if writing fails
+    void write_nhx(int fd, const NHXWriterOptions& options = {}) const;
+
+    std::string as_string() const final {
+        std::string result;
+        append_nhx(result);
+        result += ' ';
+        return result;
+    }
+
+    // Writes the finalized tree in the binary format read by MappedAnnotatedTree (to read it from
+    // out, the tree must start at an 8-byte aligned address).
+    void append_binary(std::string& out) const;
+    void write_binary(std::ostream& out) const;
+
+    // Hash of the subtree of each node, which does not depend on the order of children nor on the
+    // numbering of nodes; covers all tags (a tag with an empty value counts as absent).
+    std::vector<std::uint64_t> subtree_hashes() const;
+
+    // hash of the whole tree (see subtree_hashes): trees equal to each other have equal hashes
+    std::uint64_t canonical_hash() const;
+
+    // Trees are equal if they have the same shape up to the order of children, and matching nodes
+    // have the same value for each tag of this tree (an absent tag counts as empty). Runs in
+    // O(n log n) by giving each subtree of both trees a canonical class.
+    bool operator==(const AnnotatedTree& other) const final;
 };
 
 /*================================================================================================*/
@@ -199,6 +914,207 @@ struct NHXParserException : public std::runtime_error {
     NHXParserException(std::string s = "") : std::runtime_error(s) {}
 };
 
+/*================================================================================================*/
+// Read-only memory mapping of a whole file (POSIX).
+class MappedFile {
+    const char* data_{nullptr};
+    std::size_t size_{0};
+
+  public:
+    MappedFile() = default;
+    explicit MappedFile(const std::string& path);
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    MappedFile(MappedFile&& other) : data_(other.data_), size_(other.size_) {
+        other.data_ = nullptr;
+        other.size_ = 0;
+    }
+    MappedFile& operator=(MappedFile&& other) {
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+        return *this;
+    }
+    ~MappedFile();
+
+    const char* data() const { return data_; }
+    std::size_t size() const { return size_; }
+};
+
+/*================================================================================================*/
+// A tree in the binary format of DoubleListAnnotatedTree::append_binary, used in place: the
+// arrays of the tree (parents, children, subtree sizes, leaves, tag columns and the text they
+// point into) are stored at 8-byte aligned offsets after a versioned header, so opening a tree
+// checks the header, that every section lies within the data, and in one pass over the nodes that
+// the sections hold a tree with valid indices and tag values, without copying or parsing.
+class MappedAnnotatedTree : public AnnotatedTree {
+  public:
+    using TextRange = DoubleListAnnotatedTree::TextRange;
+
+    struct Column {
+        TextRange key;
+        bool encoded;
+        const std::uint64_t* present;
+        std::size_t present_size;
+        const TextRange* values;  // or codes, if encoded
+        const std::uint32_t* codes;
+        std::size_t values_size;
+        const TextRange* dictionary;
+        std::size_t dictionary_size;
+
+        bool has(NodeIndex node) const {
+            std::size_t word = node / 64;
+            return word < present_size and ((present[word] >> (node % 64)) & 1) != 0;
+        }
+
+        const TextRange& value(NodeIndex node) const {
+            return encoded ? dictionary[codes[node]] : values[node];
+        }
+    };
+
+    MappedFile file_;
+    const char* text_{nullptr};
+    std::size_t text_size_{0};
+    std::size_t nb_nodes_{0};
+    NodeIndex root_{0};
+    bool preorder_{false};
+    const int* parent_{nullptr};
+    const int* child_offsets_{nullptr};
+    const int* child_list_{nullptr};
+    const int* subtree_size_{nullptr};
+    const int* leaves_{nullptr};
+    const int* first_leaf_{nullptr};
+    const int* leaf_end_{nullptr};
+    std::vector<Column> columns_;
+    std::size_t nb_columns_{0};
+
+    std::string text(TextRange range) const {
+        return std::string(text_ + range.offset, range.size);
+    }
+
+    // returns the index in columns_ of the column with given key (-1 if there is none)
+    int find_column(const char* key, std::size_t key_size) const {
+        for (std::size_t column = 0; column < nb_columns_; column++) {
+            const TextRange& range = columns_[column].key;
+            if (range.size == key_size and std::memcmp(text_ + range.offset, key, key_size) == 0) {
+                return column;
+            }
+        }
+        return -1;
+    }
+
+    void check_node(NodeIndex node) const {
+        if (static_cast<std::size_t>(node) >= nb_nodes_) {
+            throw std::out_of_range("no node " + std::to_string(node));
+        }
+    }
+
+    // value of tag in column for node (nullptr if the node does not have this tag)
+    const TextRange* find_value(int column, NodeIndex node) const {
+        check_node(node);
+        if (column < -1 or column >= int(columns_.size())) {
+            throw std::out_of_range("no tag id " + std::to_string(column));
+        }
+        return column != -1 and columns_[column].has(node) ? &columns_[column].value(node)
+                                                           : nullptr;
+    }
+
+    // Reads a tree from [data, data + size), which must be 8-byte aligned and outlive this object.
+    // Throws std::runtime_error if it does not hold a tree in a supported version of the format.
+    MappedAnnotatedTree(const char* data, std::size_t size);
+
+    // maps a file written by DoubleListAnnotatedTree::write_binary
+    explicit MappedAnnotatedTree(MappedFile file);
+
+    // copy of the tree that can be modified
+    DoubleListAnnotatedTree to_tree() const;
+
+    ChildrenList children(NodeIndex node) const final {
+        check_node(node);
+        return ChildrenList(child_list_ + child_offsets_[node],
+                            child_list_ + child_offsets_[node + 1]);
+    }
+
+    NodeIndex parent(NodeIndex node) const final {
+        check_node(node);
+        return parent_[node];
+    }
+
+    NodeIndex root() const final { return root_; }
+
+    std::size_t nb_nodes() const final { return nb_nodes_; }
+
+    TagValue tag(NodeIndex node, const TagName& tag) const final {
+        return this->tag(node, tag_id(tag)).str();
+    }
+
+    TagId tag_id(const TagName& tag) const final { return find_column(tag.data(), tag.size()); }
+
+    StringView tag(NodeIndex node, TagId tag) const final {
+        const TextRange* value = find_value(tag, node);
+        return value != nullptr ? StringView(text_ + value->offset, value->size) : StringView();
+    }
+
+    // as DoubleListAnnotatedTree::append_nhx (without copy_source, as there is no source)
+    void append_nhx(std::string& out, const NHXWriterOptions& options = {}) const;
+
+    std::string as_string() const final {
+        std::string result;
+        append_nhx(result);
+        result += ' ';
+        return result;
+    }
+
+    // as DoubleListAnnotatedTree::subtree_hashes and canonical_hash
+    std::vector<std::uint64_t> subtree_hashes() const;
+    std::uint64_t canonical_hash() const;
+
+    // as DoubleListAnnotatedTree::operator==
+    bool operator==(const AnnotatedTree& other) const final;
+
+    NodeRange leaves(NodeIndex node) const final {
+        check_node(node);
+        return NodeRange(leaves_ + first_leaf_[node], leaves_ + leaf_end_[node]);
+    }
+
+    std::size_t subtree_size(NodeIndex node) const final {
+        check_node(node);
+        return subtree_size_[node];
+    }
+
+    bool is_preorder() const final { return preorder_; }
+
+    IndexRange subtree_range(NodeIndex node) const final {
+        check_node(node);
+        if (not preorder_) {
+            throw std::logic_error("tree is not numbered in preorder");
+        }
+        return IndexRange(node, node + subtree_size_[node]);
+    }
+};
+
+/*================================================================================================*/
+// Number of nodes of the first tree in [data, data + size), i.e., one more than its number of
+// commas and opening parentheses outside comments and NHX blocks (exact for well-formed trees).
+// Found with a fast pass over the input, to size per-node buffers before parsing.
+std::size_t predicted_nb_nodes(const char* data, std::size_t size);
+
+/*================================================================================================*/
+// Options of NHXParser, NHXTreeReader and parse_tree_collection
+struct NHXParserOptions {
+    // tags whose values are dictionary-encoded (see DoubleListAnnotatedTree::dictionary_encode)
+    std::vector<std::string> dictionary_tags;
+
+    // where the memory of parsed trees comes from, if not null (see DoubleListAnnotatedTree);
+    // ignored by parse_tree_collection, which builds trees concurrently
+    Arena* arena{nullptr};
+
+    // Records the text of each node in the input, so that writing the tree copies the text of
+    // subtrees not modified since (see NHXWriterOptions::copy_source). The input must then
+    // outlive the trees and their copies, so it must be owned by the caller: streams and files
+    // moved into an NHXTreeReader are rejected (std::invalid_argument).
+    bool record_spans{false};
+};
+
 /*================================================================================================*/
 class NHXParser : public TreeParser {
     // list of tokens for lexer
@@ -215,167 +1131,495 @@ class NHXParser : public TreeParser {
         Identifier,
         Invalid
     };
-    std::map<TokenType, std::string> token_names{{OpenParenthesis, "OpenParenthesis"},
-                                                 {CloseParenthesis, "CloseParenthesis"},
-                                                 {Colon, "Colon"},
-                                                 {Semicolon, "Semicolon"},
-                                                 {Comma, "Comma"},
-                                                 {Equal, "Equal"},
-                                                 {NHXOpen, "NHXOpen"},
-                                                 {CommentOpen, "CommentOpen"},
-                                                 {BracketClose, "BracketClose"},
-                                                 {Identifier, "Identifier"},
-                                                 {Invalid, "Invalid"}};
-    using Token = std::pair<TokenType, std::string>;  // first: index of token, second: token value
+
+    static const char* token_name(TokenType type) {
+        static const char* names[] = {"OpenParenthesis", "CloseParenthesis", "Colon",
+                                      "Semicolon",       "Comma",            "Equal",
+                                      "NHXOpen",         "CommentOpen",      "BracketClose",
+                                      "Identifier",      "Invalid"};
+        return names[type];
+    }
+
+    // tokens are views into input
+    struct Token {
+        TokenType type;
+        std::size_t offset;
+        std::size_t length;
+    };
 
     // input/output
+    NHXParserOptions options;
     DoubleListAnnotatedTree tree;
 
     // state during parsing
-    using scit = std::string::const_iterator;
-    scit it;
-    Token next_token{Invalid, ""};
-    std::string input{""};
+    const char* input_begin{nullptr};
+    const char* input_end{nullptr};
+    const char* it{nullptr};
+    Token next_token{Invalid, 0, 0};
+    std::string input{""};  // owned copy of the input when parsing from a stream
     int next_node{0};
 
+    const char* token_data(const Token& token) const { return input_begin + token.offset; }
+
+    // token as it should appear in error messages
+    std::string token_string(const Token& token) const {
+        if (token.type != Invalid) {
+            return std::string(token_data(token), token.length);
+        } else if (token_data(token) == input_end) {
+            return "end of input";
+        } else if (*token_data(token) == '[') {
+            return "unterminated comment";
+        } else {
+            return "token starting with " + std::string(token_data(token), 1);
+        }
+    }
+
     [[noreturn]] void error(std::string s) {
         std::stringstream ss;
         ss << s;
-        ss << "Error at position " << std::distance(scit(input.begin()), it) << ":\n";
-        bool at_begining = it - 15 <= input.begin();
-        bool at_end = it + 15 >= input.end();
+        std::size_t position = it - input_begin;
+        ss << "Error at position " << position << ":\n";
+        bool at_begining = position <= 15;
+        bool at_end = input_end - it <= 15;
         ss << "\t" << (at_begining ? "" : "...")
-           << std::string(at_begining ? input.begin() : it - 15, at_end ? input.end() : it + 15)
+           << std::string(at_begining ? input_begin : it - 15, at_end ? input_end : it + 15)
            << (at_end ? "" : "...") << "\n";
-        ss << "\t" << (at_begining ? "" : "   ")
-           << std::string(at_begining ? std::distance(scit(input.begin()), it) : 15, ' ') << "^\n";
+        ss << "\t" << (at_begining ? "" : "   ") << std::string(at_begining ? position : 15, ' ')
+           << "^\n";
         throw NHXParserException(ss.str());
     }
 
-    std::string expect(TokenType type) {
+    Token expect(TokenType type) {
         find_token();
-        if (next_token.first != type) {
-            error("Error: expected token " + token_names.at(type) + " but got token " +
-                  token_names.at(next_token.first) + "(" + next_token.second + ") instead.\n");
+        if (next_token.type != type) {
+            error(std::string("Error: expected token ") + token_name(type) + " but got token " +
+                  token_name(next_token.type) + "(" + token_string(next_token) + ") instead.\n");
         } else {
-            return next_token.second;
+            return next_token;
         }
     }
 
+    void set_tag(int node, const char* key, std::size_t key_size, const Token& value) {
+        tree.set_tag(node, key, key_size, token_data(value), value.length);
+    }
+
     // lexer
     void find_token();
 
-    // parser
-    void node_nothing(int number, int parent) {
-        tree.nodes_.emplace_back();
-        tree.parent_.push_back(parent);
-        tree.children_.emplace_back();
-        if (parent != -1) {
-            tree.children_.at(parent).push_back(number);
-        }
+    static std::string read_stream(std::istream& is);
 
-        find_token();
-        switch (next_token.first) {
-            case Identifier:
-                tree.nodes_[number]["name"] = next_token.second;
-                node_name(number, parent);
-                break;
-            case Colon:
-                node_length(number, parent);
-                break;
-            case NHXOpen:
-                data(number, parent);
-                break;
-            case OpenParenthesis:
-                next_node++;
-                node_nothing(next_node, number);
-                break;
-            default:
-                node_end(parent);
-        }
-    }
-
-    void node_name(int number, int parent) {
-        find_token();
-        switch (next_token.first) {
-            case Colon:
-                node_length(number, parent);
-                break;
-            case NHXOpen:
-                data(number, parent);
-                break;
-            case Identifier:
-                tree.nodes_[number]["name"] = next_token.second;
-                node_name(number, parent);
-                break;
-            default:
-                node_end(parent);
+    // parser states
+    enum State { NodeNothing, NodeName, NodeLength, Data, NodeEnd, Done };
+
+    // Non-recursive state machine; the only stack is the explicit list of open internal nodes, so
+    // native stack usage does not depend on the size or depth of the tree.
+    // nb_nodes is the predicted number of nodes, if already known (0 if not)
+    void parse(const char* data, std::size_t size, std::size_t nb_nodes = 0) {
+        if (size == 0) {
+            throw NHXParserException("Error: empty input stream!\n");
         }
-    }
+        input_begin = data;
+        input_end = data + size;
+        it = data;
+        next_node = 0;
+        tree.clear();
+        tree.reserve(nb_nodes != 0 ? nb_nodes : predicted_nb_nodes(data, size));
+        if (options.record_spans) {
+            tree.spans_.reserve(tree.reserved_nodes_);
+        }
+        for (auto& tag : options.dictionary_tags) {
+            tree.dictionary_encode(tag);
+        }
+
+        std::vector<int> open_nodes;  // internal nodes whose closing parenthesis is still ahead
+        int number = 0;
+        State state = NodeNothing;
+        while (state != Done) {
+            int parent = open_nodes.empty() ? -1 : open_nodes.back();
+            switch (state) {
+                case NodeNothing:
+                    tree.add_node(parent);
+                    find_token();
+                    if (options.record_spans) {
+                        tree.spans_.push_back({next_token.offset, 0});
+                    }
+                    switch (next_token.type) {
+                        case Identifier:
+                            set_tag(number, "name", 4, next_token);
+                            state = NodeName;
+                            break;
+                        case Colon:
+                            state = NodeLength;
+                            break;
+                        case NHXOpen:
+                            state = Data;
+                            break;
+                        case OpenParenthesis:
+                            open_nodes.push_back(number);
+                            number = ++next_node;
+                            break;
+                        default:
+                            state = NodeEnd;
+                    }
+                    break;
+
+                case NodeName:
+                    find_token();
+                    switch (next_token.type) {
+                        case Colon:
+                            state = NodeLength;
+                            break;
+                        case NHXOpen:
+                            state = Data;
+                            break;
+                        case Identifier:
+                            set_tag(number, "name", 4, next_token);
+                            break;
+                        default:
+                            state = NodeEnd;
+                    }
+                    break;
 
-    void node_length(int number, int parent) {
-        tree.nodes_[number]["length"] = expect(Identifier);
+                case NodeLength:
+                    set_tag(number, "length", 6, expect(Identifier));
+                    find_token();
+                    state = next_token.type == NHXOpen ? Data : NodeEnd;
+                    break;
 
-        find_token();
-        switch (next_token.first) {
-            case NHXOpen:
-                data(number, parent);
-                break;
-            default:
-                node_end(parent);
-        }
-    }
-
-    void node_end(int parent) {
-        switch (next_token.first) {
-            case Comma:
-                next_node++;
-                node_nothing(next_node, parent);
-                break;
-            case CloseParenthesis: {
-                if (parent != -1) {
-                    node_name(parent, tree.parent_.at(parent));
-                }
-                break;
+                case NodeEnd:
+                    if (options.record_spans) {
+                        record_span_end(number);
+                    }
+                    switch (next_token.type) {
+                        case Comma:
+                            number = ++next_node;
+                            state = NodeNothing;
+                            break;
+                        case CloseParenthesis:
+                            if (parent != -1) {
+                                number = parent;
+                                open_nodes.pop_back();
+                                state = NodeName;
+                            } else {
+                                state = Done;
+                            }
+                            break;
+                        case Semicolon:
+                            state = Done;
+                            break;
+                        default:
+                            error("Error: unexpected " + token_string(next_token) + '\n');
+                    }
+                    break;
+
+                case Data:
+                    find_token();
+                    if (next_token.type == BracketClose) {
+                        find_token();
+                        state = NodeEnd;
+                    } else if (next_token.type == Identifier) {
+                        Token tag = next_token;
+                        expect(Equal);
+                        set_tag(number, token_data(tag), tag.length, expect(Identifier));
+                    } else if (next_token.type != Colon) {
+                        error("Error: improperly formatted contents in NHX data. Found unexpected " +
+                              token_string(next_token) + '\n');
+                    }
+                    break;
+
+                case Done:
+                    break;
             }
-            case Semicolon:
-                break;
-            default:
-                error("Error: unexpected " + next_token.second + '\n');
+        }
+        tree.finalize();
+        if (options.record_spans) {
+            tree.set_source(input_begin);
         }
     }
 
-    void data(int number, int parent) {
-        find_token();
-        if (next_token.first == BracketClose) {
-            find_token();
-            node_end(parent);
-        } else if (next_token.first == Identifier) {
-            std::string tag = next_token.second;
-            expect(Equal);
-            tree.nodes_[number][tag] = expect(Identifier);
-            data(number, parent);
-        } else if (next_token.first == Colon) {
-            data(number, parent);
-        } else {
-            error("Error: improperly formatted contents in NHX data. Found unexpected " +
-                  next_token.second + '\n');
+    // the span of node ends before next_token and the spaces preceding it
+    void record_span_end(int node) {
+        std::size_t end = next_token.offset;
+        auto& span = tree.spans_[node];
+        while (end > span.offset and (input_begin[end - 1] == ' ' or
+                                      static_cast<unsigned>(input_begin[end - 1] - '\t') < 5)) {
+            end--;
         }
+        span.size = end - span.offset;
     }
 
-  public:
-    NHXParser(std::istream& is) {
-        tree = DoubleListAnnotatedTree();
-        tree.root_ = 0;
-        input = std::string(std::istreambuf_iterator<char>(is), {});
-        it = input.begin();
+    friend class NHXTreeReader;
+    friend struct TreeCollectionParser;
+    explicit NHXParser(const NHXParserOptions& options) : options(options), tree(options.arena) {}
 
-        if (input.length() == 0) {
-            throw NHXParserException("Error: empty input stream!\n");
+    // options for an input that the parser or reader owns, where spans cannot be recorded as the
+    // input does not outlive the trees
+    static const NHXParserOptions& owned_input(const NHXParserOptions& options) {
+        if (options.record_spans) {
+            throw std::invalid_argument("spans are only recorded from input owned by the caller");
         }
+        return options;
+    }
 
-        node_nothing(0, -1);
+  public:
+    NHXParser(std::istream& is, const NHXParserOptions& options = NHXParserOptions())
+        : options(owned_input(options)), tree(options.arena) {
+        input = read_stream(is);
+        parse(input.data(), input.size());
+    }
+
+    // parses size bytes starting at data, without copying them (data is not used after parsing,
+    // unless options.record_spans)
+    NHXParser(const char* data, std::size_t size,
+              const NHXParserOptions& options = NHXParserOptions())
+        : options(options), tree(options.arena) {
+        parse(data, size);
+    }
+
+    explicit NHXParser(const MappedFile& file, const NHXParserOptions& options = NHXParserOptions())
+        : options(options), tree(options.arena) {
+        parse(file.data(), file.size());
     }
 
     const AnnotatedTree& get_tree() const final { return tree; }
 };
+
+/*================================================================================================*/
+// Finds where trees end in a sequence of ';'-terminated trees. Semicolons in comments and NHX
+// blocks are skipped. Scanning can stop at the end of a buffer and resume when more input is
+// available. Nodes are counted along the way (see predicted_nb_nodes).
+class TreeEndScanner {
+    enum State { TopLevel, InData, InComment, InDataComment };
+    State state{TopLevel};
+    std::size_t nb_separators{0};  // commas and opening parentheses of the current tree
+    bool tree_done{false};         // true once the semicolon of the current tree is found
+
+  public:
+    // Scans [begin, end). If a tree ends there, returns the position just after its semicolon and
+    // sets found to true (the scanner is then ready for the next tree). Otherwise returns the
+    // position where scanning stopped, to pass as begin once more input is available (unless
+    // at_end, meaning that no input follows end, a bracket too close to end is left unscanned, as
+    // it could open an NHX block).
+    const char* scan(const char* begin, const char* end, bool at_end, bool& found);
+
+    // predicted number of nodes of the tree scanned so far (or of the tree just found)
+    std::size_t nb_nodes() const { return nb_separators + 1; }
+};
+
+/*================================================================================================*/
+// Reads a sequence of ';'-terminated trees (e.g., MCMC samples or bootstrap replicates) one tree at
+// a time. Memory use is bounded by the size of the largest tree, and buffers are reused from one
+// tree to the next.
+class NHXTreeReader : public TreeParser {
+    NHXParser parser;
+    TreeEndScanner scanner;
+    std::size_t nb_trees{0};
+
+    // stream input: buffer holds unparsed input, the next tree starts at buffer_begin
+    std::istream* stream{nullptr};
+    std::string buffer;
+    std::size_t buffer_begin{0};
+    std::size_t scan_position{0};  // where to resume scanning, relative to buffer
+
+    // in-memory input: the next tree starts at position
+    MappedFile file;
+    const char* position{nullptr};
+    const char* end{nullptr};
+
+    void parse(const char* data, std::size_t size, std::size_t nb_nodes);
+    bool next_from_stream();
+
+  public:
+    explicit NHXTreeReader(std::istream& is, const NHXParserOptions& options = NHXParserOptions())
+        : parser(NHXParser::owned_input(options)), stream(&is) {}
+
+    // reads from size bytes starting at data, which must outlive the reader
+    NHXTreeReader(const char* data, std::size_t size,
+                  const NHXParserOptions& options = NHXParserOptions())
+        : parser(options), position(data), end(data + size) {}
+
+    explicit NHXTreeReader(MappedFile&& mapped_file,
+                           const NHXParserOptions& options = NHXParserOptions())
+        : parser(NHXParser::owned_input(options)),
+          file(std::move(mapped_file)),
+          position(file.data()),
+          end(file.data() + file.size()) {}
+
+    // parses the next tree; returns false (and leaves the last tree untouched) if there is none
+    bool next_tree();
+
+    // number of trees read so far
+    std::size_t nb_trees_read() const { return nb_trees; }
+
+    const AnnotatedTree& get_tree() const final { return parser.get_tree(); }
+};
+
+/*================================================================================================*/
+// Parses all the ';'-terminated trees of a collection on nb_threads threads (0 means one per
+// hardware thread) and returns them in input order. Trees are located first with a sequential
+// TreeEndScanner pass, then parsed independently.
+std::vector<DoubleListAnnotatedTree> parse_tree_collection(
+    const char* data, std::size_t size, unsigned nb_threads = 0,
+    const NHXParserOptions& options = NHXParserOptions());
+
+inline std::vector<DoubleListAnnotatedTree> parse_tree_collection(
+    const MappedFile& file, unsigned nb_threads = 0,
+    const NHXParserOptions& options = NHXParserOptions()) {
+    return parse_tree_collection(file.data(), file.size(), nb_threads, options);
+}
+
+/*================================================================================================*/
+// Robinson-Foulds distance between two trees seen as unrooted, with leaves matched by their name
+// tag: the number of nontrivial splits (bipartitions of the leaves by an internal edge) found in
+// only one of the trees. Both trees must have the same set of distinct leaf names, otherwise
+// std::invalid_argument is thrown. Runs in linear time (Day's algorithm).
+struct RFDistance {
+    std::size_t distance;  // number of splits in only one of the trees
+    double normalized;     // distance over the total number of splits of both trees (0 if none)
+};
+
+RFDistance robinson_foulds(const AnnotatedTree& a, const AnnotatedTree& b);
+
+/*================================================================================================*/
+// Distinct nontrivial splits of trees on a shared set of leaf names (see robinson_foulds). Leaves
+// are numbered by the first tree added, and each split is stored as a bitset of leaf numbers: the
+// side that does not contain leaf 0.
+class SplitDictionary {
+    std::vector<std::string> leaf_names_;
+    std::vector<int> leaf_slots_;  // hash table of leaf names: number + 1 of the leaf there, or 0
+    std::size_t nb_words_{0};  // per split
+    std::size_t nb_splits_{0};
+    std::vector<std::uint64_t> splits_;  // split i is words [i * nb_words_, (i + 1) * nb_words_)
+    std::vector<int> slots_;             // hash table: id + 1 of the split hashed there, or 0
+
+    // sets leaf names (std::invalid_argument if they are not unique)
+    void set_leaf_names(const std::vector<std::string>& leaf_names);
+
+    // number of the leaf with given name (-1 if there is none)
+    int find_leaf(StringView name) const;
+
+  public:
+    SplitDictionary() = default;
+
+    // dictionary on given leaf names, in this order, instead of those of the first tree added
+    explicit SplitDictionary(const std::vector<std::string>& leaf_names);
+
+    // Returns the sorted ids of the splits of tree, adding the new ones. Throws
+    // std::invalid_argument if the leaf names of tree are not unique or differ from previous trees.
+    std::vector<int> add(const AnnotatedTree& tree);
+
+    // returns the id of a split given as a bitset like those of split(), adding it if it is new
+    int add_split(const std::uint64_t* split);
+
+    // Number in this dictionary of each leaf of other, to add splits of other with add_split.
+    // Throws std::invalid_argument if the leaf names are not the same (in any order).
+    std::vector<int> renumbering(const SplitDictionary& other) const;
+
+    // adds a split of other, given the renumbering of its leaves
+    int add_split(const SplitDictionary& other, int split, const std::vector<int>& renumbering);
+
+    std::size_t size() const { return nb_splits_; }
+    std::size_t nb_leaves() const { return leaf_names_.size(); }
+    const std::vector<std::string>& leaf_names() const { return leaf_names_; }
+    const std::string& leaf_name(int leaf) const { return leaf_names_.at(leaf); }
+
+    // split as a bitset of nb_words() words (bit i of word w stands for leaf 64 * w + i)
+    const std::uint64_t* split(int split) const { return splits_.data() + split * nb_words_; }
+    std::size_t nb_words() const { return nb_words_; }
+
+    // whether leaf is in the side of split that does not contain leaf 0
+    bool contains(int split, int leaf) const {
+        return (splits_[split * nb_words_ + leaf / 64] >> (leaf % 64)) & 1;
+    }
+};
+
+// Robinson-Foulds distances between all pairs of trees of a collection on a shared set of leaf
+// names, as computed by robinson_foulds.
+struct RFMatrix {
+    std::size_t nb_trees;
+    std::vector<std::size_t> nb_splits;  // of each tree
+    std::vector<std::size_t> distances;  // distance between trees i and j at i * nb_trees + j
+
+    RFDistance operator()(std::size_t i, std::size_t j) const {
+        std::size_t distance = distances.at(i * nb_trees + j);
+        std::size_t total = nb_splits.at(i) + nb_splits.at(j);
+        return RFDistance{distance, total != 0 ? double(distance) / total : 0.0};
+    }
+};
+
+// Splits of all trees are collected once in a SplitDictionary, so that each tree becomes a bitset
+// of split ids and the number of splits two trees share is the popcount of their intersection. The
+// matrix is filled by square tiles of trees (whose bitsets stay in cache) on nb_threads threads (0
+// means one per hardware thread).
+RFMatrix robinson_foulds_matrix(const std::vector<DoubleListAnnotatedTree>& trees,
+                                unsigned nb_threads = 0);
+
+/*================================================================================================*/
+// Number of trees that have each split, accumulated tree by tree without keeping the trees (e.g.,
+// fed by an NHXTreeReader, or see count_splits). Accumulators can be filled independently, one per
+// thread, then merged; merging is cheaper when they number leaves the same way (see constructor).
+class SplitFrequencies {
+    SplitDictionary splits_;
+    std::vector<std::size_t> counts_;  // by split id
+    std::size_t nb_trees_{0};
+
+  public:
+    SplitFrequencies() = default;
+
+    // accumulator on given leaf names (see SplitDictionary)
+    explicit SplitFrequencies(const std::vector<std::string>& leaf_names) : splits_(leaf_names) {}
+
+    void add(const AnnotatedTree& tree) {
+        std::vector<int> splits = splits_.add(tree);
+        counts_.resize(splits_.size(), 0);
+        for (auto split : splits) {
+            counts_[split]++;
+        }
+        nb_trees_++;
+    }
+
+    // adds the counts of other, which must have the same leaf names (std::invalid_argument if not)
+    void merge(const SplitFrequencies& other);
+
+    const SplitDictionary& splits() const { return splits_; }
+    std::size_t nb_trees() const { return nb_trees_; }
+    std::size_t count(int split) const { return counts_.at(split); }
+    double frequency(int split) const { return double(count(split)) / nb_trees_; }
+};
+
+// Split frequencies of the trees of a collection (see parse_tree_collection), skipping the first
+// burnin trees. Trees are parsed and counted on nb_threads threads, each with its own accumulator.
+SplitFrequencies count_splits(const char* data, std::size_t size, unsigned nb_threads = 0,
+                              std::size_t burnin = 0,
+                              const NHXParserOptions& options = NHXParserOptions());
+
+inline SplitFrequencies count_splits(const MappedFile& file, unsigned nb_threads = 0,
+                                     std::size_t burnin = 0,
+                                     const NHXParserOptions& options = NHXParserOptions()) {
+    return count_splits(file.data(), file.size(), nb_threads, burnin, options);
+}
+
+// Average standard deviation of split frequencies between chains (ASDSF), a convergence diagnostic
+// of MCMC runs: the standard deviation (with n - 1 degrees of freedom) of the frequency of each
+// split across chains, averaged over splits whose frequency reaches min_frequency in some chain.
+// Chains must have the same leaf names (std::invalid_argument otherwise, or if there is only one).
+double average_standard_deviation(const std::vector<SplitFrequencies>& chains,
+                                  double min_frequency = 0.1);
+
+/*================================================================================================*/
+// Options of consensus_tree
+struct ConsensusOptions {
+    // after the majority-rule splits, add the other splits by decreasing frequency when they are
+    // compatible with those already there (greedy, or extended majority-rule consensus)
+    bool greedy{false};
+
+    // tag of internal nodes for the frequency of their split
+    std::string support_tag{"support"};
+};
+
+// Majority-rule consensus of the trees counted in frequencies: the tree with the splits found in
+// more than half of them, with leaves named after those of the trees. It is rooted at the parent of
+// leaf 0 (see SplitDictionary), and the internal nodes below the root have the frequency of their
+// split as a tag. Without leaves, it is an empty finalized tree.
+DoubleListAnnotatedTree consensus_tree(const SplitFrequencies& frequencies,
+                                       const ConsensusOptions& options = ConsensusOptions());
@@ -55,7 +55,7 @@ int main() {
     for (size_t i = 0; i < tree.nb_nodes(); i++) {
         cout << "Node " << i << " (" << tree.tag(i, "name") << ":" << tree.tag(i, "length")
              << "), parent: " << tree.parent(i) << ", children: ";
-        auto& children = tree.children(i);
+        auto children = tree.children(i);
         for (auto child : children) {
             cout << child << " ";
         }
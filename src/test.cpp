@@ -26,8 +26,11 @@ The fact that you are presently reading this means that you have had knowledge o
 license and that you accept its terms.*/
 
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#define DOCTEST_CONFIG_NO_POSIX_SIGNALS  // SIGSTKSZ is not a constant in recent glibc
 #include <chrono>
 #include <fstream>
+#include <random>
+#include <set>
 #include "doctest.h"
 #include "nhx-parser.hpp"
 
@@ -43,6 +46,13 @@ using namespace std;
     }                              \
     CHECK(error_ss.str() == message);
 
+string read_file(const string& path) {
+    ifstream f(path);
+    stringstream ss;
+    ss << f.rdbuf();
+    return ss.str();
+}
+
 TEST_CASE("Error: invalid token") {
     stringstream ss{"aopzioei+++++)&é')\"àqspoira"};
 
@@ -124,3 +134,918 @@ TEST_CASE("Medium-sized tree (110 nodes).") {
     NHXParser parser_write(ss_write);
     CHECK(parser_write.get_tree() == tree);
 }
+
+TEST_CASE("Lexer: whitespace and unterminated comments.") {
+    stringstream ss{"( A ,\n\tB\r\n) C ;"};
+    NHXParser parser(ss);
+    CHECK(parser.get_tree().nb_nodes() == 3);
+    CHECK(parser.get_tree().tag(0, "name") == "C");
+    CHECK(parser.get_tree().tag(2, "name") == "B");
+
+    stringstream ss_error{"(A,B)[unterminated"};
+    TEST_ERROR { NHXParser parser_error(ss_error); }
+    TEST_ERROR_END(
+        "Error: unexpected unterminated comment\nError at position 18:\n\t...B)[unterminated\n\t"
+        "                  ^\n");
+}
+
+TEST_CASE("Deep trees do not grow the native stack.") {
+    const int depth = 1000000;
+    stringstream ss{string(depth, '(') + "A" + string(depth, ')') + ";"};
+    NHXParser parser(ss);
+    auto& tree = parser.get_tree();
+    CHECK(tree.nb_nodes() == depth + 1);
+    CHECK(tree.parent(depth) == depth - 1);
+    CHECK(tree.tag(depth, "name") == "A");
+    CHECK((tree.children(depth - 1) == std::vector<int>{depth}));
+}
+
+TEST_CASE("Building a tree by hand.") {
+    DoubleListAnnotatedTree tree;
+    auto root = tree.add_node(-1);
+    auto a = tree.add_node(root);
+    auto b = tree.add_node(root);
+    tree.set_tag(a, "name", "A");
+    tree.set_tag(b, "name", "B");
+    tree.set_tag(b, "length", "0.5");
+    tree.set_tag(b, "S", "human");
+    tree.set_tag(b, "name", "C");
+    CHECK_THROWS_AS(tree.children(root), const std::logic_error&);
+    tree.finalize();
+    CHECK((tree.children(root) == std::vector<int>{a, b}));
+    CHECK(tree.children(a).empty());
+    CHECK(tree.nb_nodes() == 3);
+    CHECK(tree.tag(b, "name") == "C");
+    CHECK(tree.tag(b, "E") == "");
+    CHECK(tree.as_string() == "(A,C:0.5[&&NHX:S=human]); ");
+    CHECK_THROWS_AS(tree.tag(3, "name"), const std::out_of_range&);
+    CHECK_THROWS_AS(tree.set_tag(3, "name", "D"), const std::out_of_range&);
+    CHECK_THROWS_AS(tree.add_node(-1), const std::logic_error&);  // a second root
+    CHECK(tree.nb_nodes() == 3);
+}
+
+TEST_CASE("Writing NHX.") {
+    NHXParser parser{MappedFile("data/tree1.nhx")};
+    auto& tree = dynamic_cast<const DoubleListAnnotatedTree&>(parser.get_tree());
+    string text;
+    tree.append_nhx(text);
+    CHECK(text + " " == tree.as_string());
+    auto reparsed = parse_tree_collection(text.data(), text.size(), 1).at(0);
+    CHECK(reparsed == tree);
+
+    // a caterpillar deep enough to overflow the stack of a recursive writer, longer than a chunk
+    DoubleListAnnotatedTree deep;
+    int node = deep.add_node(-1);
+    for (int i = 0; i < 200000; i++) {
+        deep.set_tag(deep.add_node(node), "name", "L" + to_string(i));
+        node = deep.add_node(node);
+    }
+    deep.set_tag(node, "name", "last");
+    deep.set_tag(node, "length", "1");
+    deep.set_tag(node, "S", "human");
+    deep.finalize();
+    text.clear();
+    deep.append_nhx(text);
+    CHECK(text.compare(0, 8, "(L0,(L1,") == 0);
+    string end = "(L199999,last:1[&&NHX:S=human]" + string(200000, ')') + ";";
+    CHECK(text.compare(text.size() - end.size(), end.size(), end) == 0);
+    stringstream stream;
+    deep.write_nhx(stream);
+    CHECK(stream.str() == text);
+    FILE* file = tmpfile();
+    deep.write_nhx(fileno(file));
+    rewind(file);
+    string written(text.size() + 1, 0);
+    written.resize(fread(&written[0], 1, written.size(), file));
+    fclose(file);
+    CHECK(written == text);
+    CHECK_THROWS_AS(deep.write_nhx(-1), const std::runtime_error&);
+    CHECK_THROWS_AS(DoubleListAnnotatedTree().append_nhx(text), const std::logic_error&);
+}
+
+TEST_CASE("Canonical NHX.") {
+    auto parse = [](const string& input) {
+        return parse_tree_collection(input.data(), input.size(), 1).at(0);
+    };
+    NHXWriterOptions canonical;
+    canonical.sorted_tags = true;
+    canonical.sorted_children = true;
+    auto write = [](const DoubleListAnnotatedTree& tree, const NHXWriterOptions& options) {
+        string result;
+        tree.append_nhx(result, options);
+        return result;
+    };
+    auto a = parse("((B:1[&&NHX:S=x:Ev=D],A),C);");
+    auto b = parse("(C,(A,B:1[&&NHX:Ev=D:S=x]));");
+    for (int node = 0; node < int(a.nb_nodes()); node++) {
+        if (a.tag(node, "name") == "C") {
+            a.set_tag(node, "S", "");  // left out like a missing tag
+        }
+    }
+    CHECK(a == b);
+    CHECK(write(a, {}) != write(b, {}));
+    CHECK(write(a, canonical) == write(b, canonical));
+    CHECK(parse(write(a, canonical)) == a);
+
+    // a tag that only the right-hand tree has is not compared, but it is written
+    auto extra = parse("(C,(A,B:1[&&NHX:Ev=D:S=x:T=1]));");
+    CHECK(a == extra);
+    CHECK(not (extra == a));
+    CHECK(write(a, canonical) != write(extra, canonical));
+
+    NHXWriterOptions sorted_tags;
+    sorted_tags.sorted_tags = true;
+    CHECK(write(a, sorted_tags) == "((B:1[&&NHX:Ev=D:S=x],A),C);");
+    CHECK(write(b, sorted_tags) == "(C,(A,B:1[&&NHX:Ev=D:S=x]));");
+
+    // the same tree with children in another order, hence numbered differently
+    NHXParser parser{MappedFile("data/tree1.nhx")};
+    auto& tree = dynamic_cast<const DoubleListAnnotatedTree&>(parser.get_tree());
+    NHXWriterOptions sorted_children;
+    sorted_children.sorted_children = true;
+    auto reordered = parse(write(tree, sorted_children));
+    CHECK(reordered == tree);
+    CHECK(write(reordered, {}) != write(tree, {}));
+    CHECK(write(reordered, canonical) == write(tree, canonical));
+}
+
+TEST_CASE("Writer options.") {
+    string input =
+        "((A:0.100000[&&NHX:S=x:Ev=D],B:2e-3)AB:0.30000000000000004[&&NHX:S=y],C:1.5)R:abc;";
+    auto tree = parse_tree_collection(input.data(), input.size(), 1).at(0);
+    auto write = [&](const NHXWriterOptions& options) {
+        string result;
+        tree.append_nhx(result, options);
+        return result;
+    };
+    NHXWriterOptions options;
+    CHECK(write(options) == input);
+    options.nhx_tags = false;
+    CHECK(write(options) == "((A:0.100000,B:2e-3)AB:0.30000000000000004,C:1.5)R:abc;");
+    options.length_digits = 0;
+    CHECK(write(options) == "((A:0.1,B:0.002)AB:0.30000000000000004,C:1.5)R:abc;");
+    options.length_digits = 2;
+    options.internal_names = false;
+    CHECK(write(options) == "((A:0.1,B:0.002):0.3,C:1.5):abc;");
+
+    options = NHXWriterOptions();
+    options.include_tags = {"name", "S"};
+    CHECK(write(options) == "((A[&&NHX:S=x],B)AB[&&NHX:S=y],C)R;");
+    options.include_tags.clear();
+    options.exclude_tags = {"length", "Ev"};
+    CHECK(write(options) == "((A[&&NHX:S=x],B)AB[&&NHX:S=y],C)R;");
+
+    // shortest round-trip lengths
+    options = NHXWriterOptions();
+    options.length_digits = 0;
+    auto shortest = [&](const string& length) {
+        DoubleListAnnotatedTree leaf;
+        leaf.set_tag(leaf.add_node(-1), "length", length);
+        leaf.finalize();
+        string written;
+        leaf.append_nhx(written, options);
+        return written.substr(1, written.size() - 2);
+    };
+    CHECK(shortest("100") == "100");
+    CHECK(shortest("100000000000000000000") == "1e+20");
+    CHECK(shortest("-0.000012500") == "-1.25e-05");
+    CHECK(shortest("0x10") == "16");
+    CHECK(shortest("1e999") == "1e999");
+    CHECK(shortest("1.5 ") == "1.5 ");
+    std::mt19937_64 rng(4);
+    for (int i = 0; i < 1000; i++) {
+        double length = std::ldexp(double(rng() >> 11), -int(rng() % 80));
+        char text[32];
+        snprintf(text, sizeof(text), i % 3 == 0 ? "%.17g" : i % 3 == 1 ? "%.12g" : "%.6g", length);
+        string shortest_text = shortest(text);
+        CHECK(std::strtod(shortest_text.c_str(), nullptr) == std::strtod(text, nullptr));
+        CHECK(shortest_text.size() <= strlen(text));
+    }
+}
+
+TEST_CASE("Binary trees.") {
+    MappedFile file("data/tree1.nhx");
+    NHXParserOptions options;
+    options.dictionary_tags = {"S"};
+    NHXParser parser(file, options);
+    auto& tree = dynamic_cast<const DoubleListAnnotatedTree&>(parser.get_tree());
+    string binary;
+    tree.append_binary(binary);
+    MappedAnnotatedTree mapped(binary.data(), binary.size());
+    CHECK(mapped.nb_nodes() == tree.nb_nodes());
+    CHECK(mapped.root() == tree.root());
+    CHECK(mapped.is_preorder() == tree.is_preorder());
+    for (auto name : {"name", "length", "S", "Ev", "Condition"}) {
+        auto id = mapped.tag_id(name);
+        CHECK(id == tree.tag_id(name));
+        for (int node = 0; node < int(tree.nb_nodes()); node++) {
+            CHECK(mapped.tag(node, id) == tree.tag(node, id));
+        }
+    }
+    for (int node = 0; node < int(tree.nb_nodes()); node++) {
+        CHECK(mapped.parent(node) == tree.parent(node));
+        auto children = tree.children(node), leaves = tree.leaves(node);
+        CHECK(mapped.children(node) == vector<int>(children.begin(), children.end()));
+        CHECK(mapped.leaves(node) == vector<int>(leaves.begin(), leaves.end()));
+        CHECK(mapped.subtree_size(node) == tree.subtree_size(node));
+    }
+    CHECK(mapped.descendant_leaves(mapped.root()) == vector<string>(tree.descendant_leaves(0)));
+    CHECK(mapped.as_string() == tree.as_string());
+    CHECK(mapped == tree);
+    CHECK(tree == mapped);
+    CHECK(mapped.canonical_hash() == tree.canonical_hash());
+    NHXWriterOptions sorted;
+    sorted.sorted_tags = true;
+    sorted.sorted_children = true;
+    string mapped_nhx, tree_nhx;
+    mapped.append_nhx(mapped_nhx, sorted);
+    tree.append_nhx(tree_nhx, sorted);
+    CHECK(mapped_nhx == tree_nhx);
+    CHECK_THROWS_AS(mapped.children(tree.nb_nodes()), const std::out_of_range&);
+
+    // the copy can be modified, including dictionary-encoded tags
+    auto copy = mapped.to_tree();
+    CHECK(copy == tree);
+    copy.set_tag(0, "S", "new species");
+    copy.set_tag(1, "S", copy.tag(2, "S"));
+    CHECK(copy.tag(0, "S") == "new species");
+    CHECK(copy.tag_code(1, copy.tag_id("S")) == copy.tag_code(2, copy.tag_id("S")));
+
+    // through a file, from an empty tree
+    {
+        ofstream out("test_tree.bin", std::ios::binary);
+        tree.write_binary(out);
+    }
+    MappedAnnotatedTree from_file(MappedFile("test_tree.bin"));
+    std::remove("test_tree.bin");
+    CHECK(from_file == tree);
+    DoubleListAnnotatedTree empty;
+    empty.finalize();
+    string empty_binary;
+    empty.append_binary(empty_binary);
+    CHECK(MappedAnnotatedTree(empty_binary.data(), empty_binary.size()).nb_nodes() == 0);
+    CHECK_THROWS_AS(DoubleListAnnotatedTree().append_binary(empty_binary), const std::logic_error&);
+
+    // invalid data
+    CHECK_THROWS_AS(MappedAnnotatedTree(binary.data(), binary.size() - 8),
+                    const std::runtime_error&);
+    CHECK_THROWS_AS(MappedAnnotatedTree(binary.data(), 16), const std::runtime_error&);
+    string other_version = binary;
+    other_version[8]++;
+    CHECK_THROWS_AS(MappedAnnotatedTree(other_version.data(), other_version.size()),
+                    const std::runtime_error&);
+    // header fields at byte 48 (text size), 120 (text offset) and 128 (columns offset)
+    for (std::size_t field : {48, 120, 128}) {
+        for (std::uint64_t value : {std::uint64_t(binary.size()), std::uint64_t(-8)}) {
+            string corrupt = binary;
+            std::memcpy(&corrupt[field], &value, sizeof(value));
+            CHECK_THROWS_AS(MappedAnnotatedTree(corrupt.data(), corrupt.size()),
+                            const std::runtime_error&);
+        }
+    }
+    // contents: a child index, a parent and the values of the first tag (a column starts with
+    // its key offset, key size, encoded, present and present size, then the values offset)
+    auto offset_at = [&](std::size_t field) {
+        std::uint64_t offset;
+        std::memcpy(&offset, &binary[field], sizeof(offset));
+        return offset;
+    };
+    std::size_t values = offset_at(offset_at(128) + 40);
+    for (std::size_t position : {offset_at(80), offset_at(64) + 4, values, values + 8}) {
+        string corrupt = binary;
+        std::int32_t value = 1 << 30;
+        std::memcpy(&corrupt[position], &value, sizeof(value));
+        CHECK_THROWS_AS(MappedAnnotatedTree(corrupt.data(), corrupt.size()),
+                        const std::runtime_error&);
+    }
+    string shifted = " " + binary;
+    CHECK_THROWS_AS(MappedAnnotatedTree(shifted.data() + 1, binary.size()),
+                    const std::invalid_argument&);
+}
+
+TEST_CASE("Copying unmodified subtrees from the source.") {
+    NHXParserOptions options;
+    options.record_spans = true;
+    auto write = [](const DoubleListAnnotatedTree& tree, const NHXWriterOptions& options) {
+        string result;
+        tree.append_nhx(result, options);
+        return result;
+    };
+    string input = " ( (A , B)[&&NHX:Ev=D:S=x] , C:1 [comment]) R ;\n";
+    NHXParser parser(input.data(), input.size(), options);
+    auto tree = dynamic_cast<const DoubleListAnnotatedTree&>(parser.get_tree());
+    CHECK(write(tree, {}) == "( (A , B)[&&NHX:Ev=D:S=x] , C:1 [comment]) R;");
+    NHXWriterOptions reformat;
+    reformat.copy_source = false;
+    CHECK(write(tree, reformat) == "((A,B)[&&NHX:Ev=D:S=x],C:1)R;");
+    NHXWriterOptions plain;
+    plain.nhx_tags = false;
+    CHECK(write(tree, plain) == "((A,B),C:1)R;");
+
+    tree.set_tag(4, "T", "1");
+    CHECK(write(tree, {}) == "((A , B)[&&NHX:Ev=D:S=x],C:1[&&NHX:T=1])R;");
+    tree.add_node(1);
+    tree.finalize();
+    CHECK(write(tree, {}) == "((A,B,)[&&NHX:Ev=D:S=x],C:1[&&NHX:T=1])R;");
+    tree.clear();
+    CHECK(tree.is_modified(0));
+
+    // trees of a collection, and the original text of a file
+    input = "((A,B)AB,C);\n(D:1,(E:2[&&NHX:S=y],F));\n";
+    auto trees = parse_tree_collection(input.data(), input.size(), 1, options);
+    CHECK(write(trees.at(0), {}) == "((A,B)AB,C);");
+    CHECK(write(trees.at(1), {}) == "(D:1,(E:2[&&NHX:S=y],F));");
+    MappedFile file("data/tree1.nhx");
+    NHXParser file_parser(file, options);
+    auto& file_tree = dynamic_cast<const DoubleListAnnotatedTree&>(file_parser.get_tree());
+    string text(file.data(), file.size());
+    text.erase(text.find(';') + 1);
+    CHECK(write(file_tree, {}) == text);
+
+    // a copy of a tree read from memory still writes its text once the reader has moved on
+    input = "(A , B) AB;\n(C,D);\n(E,F);\n";
+    NHXTreeReader reader(input.data(), input.size(), options);
+    reader.next_tree();
+    auto first = dynamic_cast<const DoubleListAnnotatedTree&>(reader.get_tree());
+    while (reader.next_tree()) {
+    }
+    CHECK(write(first, {}) == "(A , B) AB;");
+
+    // input owned by the parser or reader would not outlive the trees
+    stringstream stream(input);
+    CHECK_THROWS_AS(NHXParser(stream, options), const std::invalid_argument&);
+    CHECK_THROWS_AS(NHXTreeReader(stream, options), const std::invalid_argument&);
+    CHECK_THROWS_AS(NHXTreeReader(MappedFile("data/tree1.nhx"), options),
+                    const std::invalid_argument&);
+}
+
+TEST_CASE("Subtree ranges.") {
+    NHXParser parser{MappedFile("data/tree1.nhx")};
+    auto& tree = parser.get_tree();
+    CHECK(tree.is_preorder());
+    CHECK(tree.subtree_size(tree.root()) == tree.nb_nodes());
+    for (int node = 0; node < int(tree.nb_nodes()); node++) {
+        auto range = tree.subtree_range(node);
+        CHECK(range.size() == tree.subtree_size(node));
+        CHECK(*range.begin() == node);
+        size_t size = 1;
+        for (auto child : tree.children(node)) {
+            CHECK(range.contains(child));
+            size += tree.subtree_size(child);
+        }
+        vector<int> leaves;
+        for (auto descendant : range) {
+            if (tree.children(descendant).empty()) {
+                leaves.push_back(descendant);
+            }
+        }
+        CHECK(size == tree.subtree_size(node));
+        CHECK(tree.leaves(node) == leaves);
+        CHECK(tree.descendant_leaves(node).size() == leaves.size());
+    }
+    CHECK(tree.leaves(tree.root()).size() == 56);
+    CHECK(tree.descendant_leaves(tree.root())[0] == "ENSDNOP00000000726");
+
+    // nodes added out of preorder
+    DoubleListAnnotatedTree built;
+    auto root = built.add_node(-1);
+    auto a = built.add_node(root);
+    auto b = built.add_node(root);
+    auto c = built.add_node(a);
+    built.set_tag(b, "name", "B");
+    built.set_tag(c, "name", "C");
+    built.finalize();
+    CHECK(not built.is_preorder());
+    CHECK(built.subtree_size(a) == 2);
+    CHECK_THROWS_AS(built.subtree_range(a), const std::logic_error&);
+    CHECK((built.leaves(root) == std::vector<int>{c, b}));
+    CHECK((built.leaves(a) == std::vector<int>{c}));
+    CHECK((built.descendant_leaves(root) == std::vector<std::string>{"C", "B"}));
+}
+
+TEST_CASE("Equality and canonical hashes.") {
+    auto parse = [](const std::string& input) {
+        return parse_tree_collection(input.data(), input.size(), 1).at(0);
+    };
+    auto tree = parse("((A:1,B:2)AB:0.5[&&NHX:S=x:D=N],(C,D)CD)R;");
+    auto reordered = parse("((D,C)CD,(B:2,A:1)AB:0.5[&&NHX:D=N:S=x])R;");
+    CHECK(tree == reordered);
+    CHECK(reordered == tree);
+    CHECK(tree.canonical_hash() == reordered.canonical_hash());
+
+    for (auto different : {"((A:1,B:3)AB:0.5[&&NHX:S=x:D=N],(C,D)CD)R;",
+                           "((A:1,B:2)AB:0.5[&&NHX:S=y:D=N],(C,D)CD)R;",
+                           "((A:1,C)AB:0.5[&&NHX:S=x:D=N],(B:2,D)CD)R;",
+                           "((A:1,B:2,C)AB:0.5[&&NHX:S=x:D=N],D)CD;"}) {
+        auto other = parse(different);
+        CHECK(not(tree == other));
+        CHECK(tree.canonical_hash() != other.canonical_hash());
+    }
+
+    // subtrees that only differ deep inside, or by how identical subtrees are grouped
+    auto left = parse("(((A,B),(A,C)),((A,B),(A,C)));");
+    auto right = parse("(((A,B),(A,B)),((A,C),(A,C)));");
+    auto swapped = parse("(((C,A),(A,C)),((B,A),(A,B)));");
+    CHECK(not(left == right));
+    CHECK(right == swapped);
+
+    // a tag this tree does not have is not compared
+    auto more_tags = parse("((A:1,B:2)AB:0.5[&&NHX:S=x:D=N:E=1],(C,D)CD)R;");
+    CHECK(tree == more_tags);
+    CHECK(not(more_tags == tree));
+
+    // hashes of subtrees do not depend on node numbering
+    auto hashes = tree.subtree_hashes();
+    auto reordered_hashes = reordered.subtree_hashes();
+    CHECK(hashes[1] == reordered_hashes[4]);
+    CHECK(hashes[4] == reordered_hashes[1]);
+    CHECK(DoubleListAnnotatedTree() == DoubleListAnnotatedTree());
+}
+
+// nontrivial splits of a tree seen as unrooted, as the sorted names of the side without leaf "L0"
+set<vector<string>> naive_splits(const DoubleListAnnotatedTree& tree) {
+    vector<string> all = tree.descendant_leaves(tree.root());
+    set<vector<string>> result;
+    for (int node = 0; node < int(tree.nb_nodes()); node++) {
+        vector<string> side = tree.descendant_leaves(node);
+        if (find(side.begin(), side.end(), "L0") != side.end()) {
+            vector<string> other;
+            for (auto& name : all) {
+                if (find(side.begin(), side.end(), name) == side.end()) {
+                    other.push_back(name);
+                }
+            }
+            side = other;
+        }
+        sort(side.begin(), side.end());
+        if (side.size() >= 2 and side.size() + 2 <= all.size()) {
+            result.insert(side);
+        }
+    }
+    return result;
+}
+
+// random tree with leaves named L0 to L<nb_leaves - 1>, with internal nodes of 1 to 3 children
+string random_newick(int nb_leaves, mt19937& rng) {
+    vector<string> subtrees;
+    for (int i = 0; i < nb_leaves; i++) {
+        subtrees.push_back("L" + to_string(i));
+    }
+    shuffle(subtrees.begin(), subtrees.end(), rng);
+    while (subtrees.size() > 1 or rng() % 4 == 0) {
+        size_t arity = min<size_t>(subtrees.size(), 1 + rng() % 3);
+        string node = "(";
+        for (size_t i = 0; i < arity; i++) {
+            node += subtrees.back() + (i + 1 < arity ? "," : ")");
+            subtrees.pop_back();
+        }
+        subtrees.insert(subtrees.begin() + rng() % (subtrees.size() + 1), node);
+    }
+    return subtrees[0] + ";";
+}
+
+TEST_CASE("Robinson-Foulds distance.") {
+    auto parse = [](const std::string& input) {
+        return parse_tree_collection(input.data(), input.size(), 1).at(0);
+    };
+    auto rf = [&](const std::string& a, const std::string& b) {
+        return robinson_foulds(parse(a), parse(b));
+    };
+    CHECK(rf("((A,B),(C,D));", "(A,(B,(C,D)));").distance == 0);
+    CHECK(rf("((A,B),(C,D));", "((A,C),(B,D));").distance == 2);
+    CHECK(rf("((A,B),(C,D));", "((A,C),(B,D));").normalized == 1);
+    CHECK(rf("((A,B),C,(D,E));", "((A,C),B,(D,E));").distance == 2);
+    CHECK(rf("((A,B),C,(D,E));", "((A,C),B,(D,E));").normalized == 0.5);
+    CHECK(rf("((A,B),C,(D,E));", "(A,B,C,D,E);").distance == 2);
+    CHECK(rf("(A,B);", "(B,A);").normalized == 0);
+    CHECK_THROWS_AS(rf("((A,B),(C,D));", "((A,B),(C,E));"), const std::invalid_argument&);
+    CHECK_THROWS_AS(rf("((A,B),(C,D));", "((A,B),C);"), const std::invalid_argument&);
+    CHECK_THROWS_AS(rf("((A,A),(C,D));", "((A,A),(C,D));"), const std::invalid_argument&);
+
+    mt19937 rng(0);
+    for (int i = 0; i < 200; i++) {
+        int nb_leaves = 1 + rng() % 12;
+        auto a = parse(random_newick(nb_leaves, rng)), b = parse(random_newick(nb_leaves, rng));
+        auto a_splits = naive_splits(a), b_splits = naive_splits(b);
+        size_t shared = 0;
+        for (auto& split : a_splits) {
+            shared += b_splits.count(split);
+        }
+        auto distance = robinson_foulds(a, b);
+        CHECK(distance.distance == a_splits.size() + b_splits.size() - 2 * shared);
+        CHECK(robinson_foulds(b, a).distance == distance.distance);
+        CHECK(robinson_foulds(a, a).distance == 0);
+    }
+}
+
+TEST_CASE("Robinson-Foulds matrix.") {
+    mt19937 rng(1);
+    string input;
+    for (int i = 0; i < 150; i++) {
+        input += random_newick(70, rng) + "\n";
+    }
+    auto trees = parse_tree_collection(input.data(), input.size());
+    for (unsigned nb_threads : {1, 4}) {
+        auto matrix = robinson_foulds_matrix(trees, nb_threads);
+        CHECK(matrix.nb_trees == trees.size());
+        for (size_t i = 0; i < trees.size(); i += 7) {
+            for (size_t j = 0; j < trees.size(); j++) {
+                auto distance = robinson_foulds(trees[i], trees[j]);
+                CHECK(matrix(i, j).distance == distance.distance);
+                CHECK(matrix(j, i).normalized == distance.normalized);
+            }
+        }
+    }
+
+    SplitDictionary dictionary;
+    auto parse = [](const std::string& input) {
+        return parse_tree_collection(input.data(), input.size(), 1).at(0);
+    };
+    CHECK((dictionary.add(parse("((A,B),(C,(D,E)));")) == vector<int>{0, 1}));
+    CHECK((dictionary.add(parse("(E,D,(C,(B,A)));")) == vector<int>{0, 1}));
+    CHECK((dictionary.add(parse("((A,C),(B,(D,E)));")) == vector<int>{0, 2}));
+    CHECK(dictionary.size() == 3);
+    CHECK(dictionary.nb_leaves() == 5);
+    CHECK(dictionary.leaf_name(0) == "A");
+    int split = dictionary.add(parse("((B,C),(A,(D,E)));")).back();  // side without A: B, C
+    CHECK((dictionary.contains(split, 1) and dictionary.contains(split, 2)));
+    CHECK(not dictionary.contains(split, 3));
+    CHECK_THROWS_AS(dictionary.add(parse("((A,B),(C,D));")), const std::invalid_argument&);
+    CHECK_THROWS_AS(dictionary.add(parse("((A,B),(C,(D,F)));")), const std::invalid_argument&);
+    CHECK_THROWS_AS(dictionary.add(parse("((A,B),(C,(D,D)));")), const std::invalid_argument&);
+    CHECK(dictionary.size() == 4);
+}
+
+TEST_CASE("Split frequencies.") {
+    string input = "((A,B),(C,(D,E)));\n(E,D,(C,(B,A)));\n((A,C),(B,(D,E)));\n";
+    auto frequencies = count_splits(input.data(), input.size(), 1);
+    CHECK(frequencies.nb_trees() == 3);
+    CHECK(frequencies.splits().size() == 3);
+    auto sorted_counts = [](const SplitFrequencies& frequencies) {
+        vector<size_t> counts;
+        for (size_t split = 0; split < frequencies.splits().size(); split++) {
+            counts.push_back(frequencies.count(split));
+        }
+        sort(counts.begin(), counts.end());
+        return counts;
+    };
+    CHECK((sorted_counts(frequencies) == vector<size_t>{1, 2, 3}));
+    CHECK(count_splits(input.data(), input.size(), 1, 2).nb_trees() == 1);
+    CHECK(count_splits(input.data(), input.size(), 1, 3).nb_trees() == 0);
+
+    // parsed on several threads, or tree by tree from a stream
+    mt19937 rng(2);
+    string collection;
+    for (int i = 0; i < 300; i++) {
+        collection += random_newick(20, rng) + "\n";
+    }
+    stringstream ss{collection};
+    NHXTreeReader reader(ss);
+    SplitFrequencies streamed;
+    while (reader.next_tree()) {
+        streamed.add(reader.get_tree());
+    }
+    for (unsigned nb_threads : {1, 4}) {
+        auto parallel = count_splits(collection.data(), collection.size(), nb_threads);
+        CHECK(parallel.nb_trees() == 300);
+        CHECK(parallel.splits().size() == streamed.splits().size());
+        SplitDictionary splits = parallel.splits();
+        for (size_t split = 0; split < streamed.splits().size(); split++) {
+            int id = splits.add_split(streamed.splits().split(split));
+            CHECK(parallel.count(id) == streamed.count(split));
+        }
+    }
+
+    // a short comment at the end of a tree does not hide the trees after it
+    string short_comment = "((A,B),(C,D))[x];\n((A,C),(B,D))[];\n((A,B),(C,D));\n";
+    CHECK(count_splits(short_comment.data(), short_comment.size(), 2).nb_trees() == 3);
+    {
+        ofstream out("test_splits.nhx");
+        out << short_comment;
+    }
+    auto from_file = count_splits(MappedFile("test_splits.nhx"), 1);
+    std::remove("test_splits.nhx");
+    CHECK(from_file.nb_trees() == 3);
+    CHECK((sorted_counts(from_file) == vector<size_t>{1, 2}));
+    stringstream short_ss{short_comment};
+    NHXTreeReader short_reader(short_ss);
+    SplitFrequencies short_streamed;
+    while (short_reader.next_tree()) {
+        short_streamed.add(short_reader.get_tree());
+    }
+    CHECK(short_streamed.nb_trees() == 3);
+
+    SplitFrequencies other({"A", "B", "C", "D", "F"});
+    CHECK_THROWS_AS(frequencies.merge(other), const std::invalid_argument&);
+    string bad = input + "(A,B)+(C,D,E);\n";
+    TEST_ERROR { count_splits(bad.data(), bad.size(), 2, 1); }
+    TEST_ERROR_END(
+        "Error in tree 4:\nError: unexpected token starting with +\nError at position 6:\n\t\n(A,B)+"
+        "(C,D,E);\n\t      ^\n");
+}
+
+TEST_CASE("Average standard deviation of split frequencies.") {
+    auto frequencies = [](const string& input) {
+        return count_splits(input.data(), input.size(), 1);
+    };
+    auto first = frequencies("((A,B),(C,(D,E)));\n((A,B),(C,(D,E)));\n");
+    auto second = frequencies("((A,C),(B,(D,E)));\n((A,B),(C,(D,E)));\n");
+    auto third = frequencies("((A,C),(B,(D,E)));\n");
+    CHECK(average_standard_deviation({first, first}) == 0);
+    // AB|CDE: 1 and 0.5, DE|ABC: 1 and 1, AC|BDE: 0 and 0.5
+    CHECK(average_standard_deviation({first, second}) == doctest::Approx(sqrt(0.125) * 2 / 3));
+    CHECK(average_standard_deviation({first, second}, 0.75) == doctest::Approx(sqrt(0.125) / 2));
+    CHECK(average_standard_deviation({first, third}) == doctest::Approx(sqrt(0.5) * 2 / 3));
+    CHECK_THROWS_AS(average_standard_deviation({first}), const std::invalid_argument&);
+}
+
+TEST_CASE("Consensus trees.") {
+    auto parse = [](const string& input) {
+        return parse_tree_collection(input.data(), input.size(), 1).at(0);
+    };
+    auto supports = [](const AnnotatedTree& tree) {
+        std::multiset<string> result;
+        for (int node = 0; node < int(tree.nb_nodes()); node++) {
+            if (not tree.tag(node, "support").empty()) {
+                result.insert(tree.tag(node, "support"));
+            }
+        }
+        return result;
+    };
+    string input = "((A,B),(C,(D,E)));\n((A,B),(C,(D,E)));\n((A,C),(B,(D,E)));\n";
+    auto frequencies = count_splits(input.data(), input.size(), 1);
+    auto majority = consensus_tree(frequencies);
+    CHECK(majority.nb_nodes() == 8);
+    CHECK(robinson_foulds(majority, parse("(A,B,(C,(D,E)));")).distance == 0);
+    CHECK(supports(majority) == std::multiset<string>{"0.666667", "1"});
+
+    // AB and AC are both in half of the trees: only the greedy consensus keeps one, the first seen
+    input = "((A,B),(C,(D,E)));\n((A,C),(B,(D,E)));\n";
+    frequencies = count_splits(input.data(), input.size(), 1);
+    majority = consensus_tree(frequencies);
+    CHECK(robinson_foulds(majority, parse("(A,B,C,(D,E));")).distance == 0);
+    ConsensusOptions options;
+    options.greedy = true;
+    options.support_tag = "B";
+    auto greedy = consensus_tree(frequencies, options);
+    CHECK(robinson_foulds(greedy, parse("((A,B),C,(D,E));")).distance == 0);
+    CHECK(greedy.tag(greedy.root(), "B").empty());
+    CHECK(supports(greedy).empty());
+
+    // random trees: every majority split is in both consensus trees
+    std::mt19937 rng(7);
+    input.clear();
+    for (int i = 0; i < 20; i++) {
+        input += random_newick(12, rng) + "\n";
+    }
+    frequencies = count_splits(input.data(), input.size(), 1);
+    majority = consensus_tree(frequencies);
+    options.support_tag = "support";
+    greedy = consensus_tree(frequencies, options);
+    SplitDictionary dictionary(frequencies.splits().leaf_names());
+    auto in_majority = dictionary.add(majority), in_greedy = dictionary.add(greedy);
+    std::set<std::vector<std::uint64_t>> majority_splits;
+    for (auto split : in_majority) {
+        majority_splits.emplace(dictionary.split(split), dictionary.split(split) + 1);
+    }
+    size_t nb_majority = 0;
+    for (int split = 0; split < int(frequencies.splits().size()); split++) {
+        if (2 * frequencies.count(split) > frequencies.nb_trees()) {
+            nb_majority++;
+            auto words = frequencies.splits().split(split);
+            CHECK(majority_splits.count(std::vector<std::uint64_t>(words, words + 1)) == 1);
+        }
+    }
+    CHECK(in_majority.size() == nb_majority);
+    CHECK(supports(majority).size() == nb_majority);
+    CHECK(std::includes(in_greedy.begin(), in_greedy.end(), in_majority.begin(),
+                        in_majority.end()));
+
+    // without leaves, the consensus is an empty tree that can still be used
+    auto empty = consensus_tree(SplitFrequencies());
+    CHECK(empty.nb_nodes() == 0);
+    CHECK(empty.canonical_hash() == 0);
+    string empty_binary;
+    empty.append_binary(empty_binary);
+    CHECK(MappedAnnotatedTree(empty_binary.data(), empty_binary.size()) == empty);
+}
+
+TEST_CASE("Tags are stored by column.") {
+    NHXParser parser{MappedFile("data/tree1.nhx")};
+    auto& tree = dynamic_cast<const DoubleListAnnotatedTree&>(parser.get_tree());
+    CHECK(tree.nb_columns_ == 5);  // name, length, Ev, S and ND
+    size_t nb_names = 0;
+    for (size_t column = 0; column < tree.nb_columns_; column++) {
+        if (tree.text(tree.columns_[column].key) == "name") {
+            for (size_t node = 0; node < tree.nb_nodes(); node++) {
+                nb_names += tree.columns_[column].has(node);
+            }
+        }
+    }
+    CHECK(nb_names == 56);  // leaves only
+}
+
+TEST_CASE("Tag ids.") {
+    NHXParser parser{MappedFile("data/tree1.nhx")};
+    auto& tree = parser.get_tree();
+    auto name = tree.tag_id("name"), species = tree.tag_id("S");
+    CHECK(name != -1);
+    CHECK(tree.tag_id("Condition") == -1);
+    for (int node = 0; node < int(tree.nb_nodes()); node++) {
+        CHECK(tree.tag(node, name) == tree.tag(node, "name"));
+        CHECK(tree.tag(node, species) == tree.tag(node, "S"));
+    }
+    CHECK(tree.tag(1, tree.tag_id("Condition")).empty());
+    string leaf_name = tree.tag(4, name);
+    CHECK(leaf_name == "ENSDNOP00000000726");
+    CHECK_THROWS_AS(tree.tag(0, 42), const std::out_of_range&);
+}
+
+TEST_CASE("Dictionary-encoded tags.") {
+    MappedFile file("data/tree1.nhx");
+    NHXParser plain_parser(file);
+    NHXParserOptions options;
+    options.dictionary_tags = {"Ev", "S"};
+    NHXParser parser(file, options);
+    auto& plain_tree = dynamic_cast<const DoubleListAnnotatedTree&>(plain_parser.get_tree());
+    auto& tree = dynamic_cast<const DoubleListAnnotatedTree&>(parser.get_tree());
+    CHECK(tree == plain_tree);
+    CHECK(tree.as_string().size() == plain_tree.as_string().size());
+    CHECK(tree.text_.size() < plain_tree.text_.size());
+
+    auto event = tree.tag_id("Ev"), species = tree.tag_id("S");
+    CHECK(tree.dictionary_size(event) == 2);
+    CHECK(tree.dictionary_size(species) == 33);
+    for (int node = 0; node < int(tree.nb_nodes()); node++) {
+        CHECK(tree.tag(node, event) == plain_tree.tag(node, "Ev"));
+        CHECK(tree.decode(event, tree.tag_code(node, event)) == plain_tree.tag(node, "Ev"));
+        CHECK((tree.tag_code(node, species) == tree.tag_code(0, species)) ==
+              (tree.tag(node, "S") == tree.tag(0, "S")));
+    }
+    CHECK_THROWS_AS(tree.tag_code(0, tree.tag_id("name")), const std::invalid_argument&);
+
+    // encoding a tag after the fact
+    DoubleListAnnotatedTree built;
+    auto root = built.add_node(-1);
+    auto leaf = built.add_node(root);
+    built.finalize();
+    built.set_tag(root, "Ev", "D");
+    built.set_tag(leaf, "Ev", "D");
+    auto built_event = built.dictionary_encode("Ev");
+    built.set_tag(leaf, "Ev", "S");
+    CHECK(built.dictionary_size(built_event) == 2);
+    CHECK(built.tag_code(root, built_event) == 0);
+    CHECK(built.tag_code(leaf, built_event) == 1);
+    CHECK(built.as_string() == "([&&NHX:Ev=S])[&&NHX:Ev=D]; ");
+}
+
+TEST_CASE("Trees in an arena.") {
+    MappedFile file("data/tree1.nhx");
+    NHXParser plain_parser(file);
+    Arena arena;
+    NHXParserOptions options;
+    options.arena = &arena;
+    options.dictionary_tags = {"S"};
+    size_t capacity;
+    {
+        NHXParser parser(file, options);
+        CHECK(parser.get_tree() == plain_parser.get_tree());
+        auto& tree = dynamic_cast<const DoubleListAnnotatedTree&>(parser.get_tree());
+        DoubleListAnnotatedTree copy = tree;
+        CHECK(copy.arena_ == &arena);
+        CHECK(copy == plain_parser.get_tree());
+        capacity = arena.capacity();
+        CHECK(capacity > 0);
+    }
+    arena.reset();
+    NHXParser parser(file, options);
+    CHECK(parser.get_tree() == plain_parser.get_tree());
+    CHECK(arena.capacity() == capacity);  // blocks are reused
+
+    void* small = arena.allocate(1, 1);
+    void* aligned = arena.allocate(8, 8);
+    CHECK(reinterpret_cast<uintptr_t>(aligned) % 8 == 0);
+    CHECK(aligned != small);
+    arena.allocate(1 << 24, 8);  // larger than any block so far
+    CHECK(arena.capacity() >= capacity + (1 << 24));
+}
+
+TEST_CASE("Parsing from memory and from a mapped file.") {
+    string input = "(A:1,B:2)C;";
+    NHXParser parser(input.data(), input.size());
+    CHECK(parser.get_tree().tag(0, "name") == "C");
+
+    NHXParser mapped_parser(MappedFile("data/tree1.nhx"));
+    ifstream f("data/tree1.nhx");
+    NHXParser stream_parser(f);
+    CHECK(mapped_parser.get_tree().nb_nodes() == 111);
+    CHECK(mapped_parser.get_tree() == stream_parser.get_tree());
+
+    TEST_ERROR { MappedFile file("data/does-not-exist.nhx"); }
+    TEST_ERROR_END("Error: could not open data/does-not-exist.nhx: No such file or directory\n");
+}
+
+TEST_CASE("Predicting the number of nodes.") {
+    string input = "[a,(comment;]((A,B)[&&NHX:S=x[(,]],C:1)D; (E,F);";
+    CHECK(predicted_nb_nodes(input.data(), input.size()) == 5);
+    CHECK(predicted_nb_nodes(input.data(), 10) == 1);
+
+    for (auto file : {"data/tree1.nhx", "data/tree2.nhx"}) {
+        MappedFile mapped_file(file);
+        NHXParser parser(mapped_file);
+        CHECK(predicted_nb_nodes(mapped_file.data(), mapped_file.size()) ==
+              parser.get_tree().nb_nodes());
+    }
+}
+
+TEST_CASE("Reading several trees.") {
+    string input =
+        "(A,B)C;\n[comment; with semicolon](D:1[&&NHX:S=x[;]:E=y],E)F;\n((G,H),I); [end;]\n ";
+    stringstream ss{input};
+    NHXTreeReader stream_reader(ss);
+    NHXTreeReader memory_reader(input.data(), input.size());
+    for (auto reader : {&stream_reader, &memory_reader}) {
+        CHECK(reader->next_tree());
+        CHECK(reader->get_tree().tag(0, "name") == "C");
+        CHECK(reader->next_tree());
+        CHECK(reader->get_tree().tag(1, "E") == "y");
+        CHECK(reader->get_tree().tag(0, "name") == "F");
+        CHECK(reader->next_tree());
+        CHECK(reader->get_tree().nb_nodes() == 5);
+        CHECK(not reader->next_tree());
+        CHECK(reader->nb_trees_read() == 3);
+    }
+
+    // delimiters are searched 64 bytes at a time: move them across block boundaries
+    for (int shift = 0; shift < 64; shift++) {
+        string shifted_input = string(shift, ' ') + input + input;
+        NHXTreeReader reader(shifted_input.data(), shifted_input.size());
+        while (reader.next_tree()) {
+        }
+        CHECK(reader.nb_trees_read() == 6);
+        CHECK(reader.get_tree().nb_nodes() == 5);
+    }
+
+    // a bracket too close to the end of the input to open an NHX block is a comment
+    for (string short_comment : {"(A,B)[x];C;", "(A)[];B;"}) {
+        stringstream short_ss{short_comment};
+        NHXTreeReader short_stream_reader(short_ss);
+        NHXTreeReader short_memory_reader(short_comment.data(), short_comment.size());
+        for (auto reader : {&short_stream_reader, &short_memory_reader}) {
+            CHECK(reader->next_tree());
+            CHECK(reader->next_tree());
+            CHECK(reader->get_tree().nb_nodes() == 1);
+            CHECK(not reader->next_tree());
+            CHECK(reader->nb_trees_read() == 2);
+        }
+    }
+
+    string bad_input = "(A,B)C;\n(A,B)+;";
+    NHXTreeReader bad_reader(bad_input.data(), bad_input.size());
+    CHECK(bad_reader.next_tree());
+    TEST_ERROR { bad_reader.next_tree(); }
+    TEST_ERROR_END(
+        "Error in tree 2:\nError: unexpected token starting with +\nError at position 6:\n\t\n(A,B)+"
+        ";\n\t      ^\n");
+}
+
+TEST_CASE("Reading many trees from a stream.") {
+    string tree_string = read_file("data/tree1.nhx");
+    NHXParser single_parser(tree_string.data(), tree_string.size());
+    stringstream ss;
+    for (int i = 0; i < 50; i++) {
+        ss << tree_string << "\n";
+    }
+    NHXTreeReader reader(ss);
+    while (reader.next_tree()) {
+        CHECK(reader.get_tree() == single_parser.get_tree());
+    }
+    CHECK(reader.nb_trees_read() == 50);
+}
+
+TEST_CASE("Parsing a tree collection in parallel.") {
+    string input;
+    for (auto path : {"data/tree1.nhx", "data/tree2.nhx", "data/tree1.nhx"}) {
+        input += read_file(path) + "\n[a comment; between trees]\n";
+    }
+    for (unsigned nb_threads : {1u, 2u, 4u}) {
+        auto trees = parse_tree_collection(input.data(), input.size(), nb_threads);
+        CHECK(trees.size() == 3);
+        CHECK(trees[0].nb_nodes() == 111);
+        CHECK(trees[1].nb_nodes() == 59);
+        CHECK(trees[0] == trees[2]);
+    }
+
+    // a bracket too close to the end of the input to open an NHX block is a comment
+    for (string short_comment : {"(A,B)[x];C;", "(A)[];B;"}) {
+        auto trees = parse_tree_collection(short_comment.data(), short_comment.size(), 2);
+        CHECK(trees.size() == 2);
+        CHECK(trees.at(1).nb_nodes() == 1);
+    }
+
+    string bad_input = "(A,B)C;\n(A,B)C;\n(A,B)+;\n(A,+)C;";
+    TEST_ERROR { parse_tree_collection(bad_input.data(), bad_input.size(), 2); }
+    TEST_ERROR_END(
+        "Error in tree 3:\nError: unexpected token starting with +\nError at position 6:\n\t\n(A,B)+"
+        ";\n\t      ^\n");
+}